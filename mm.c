@@ -40,7 +40,7 @@
  *
  * For larger ones:
  * 
- * [Header][Next ptr][Prev ptr][Left ptr][Right ptr][Label][XXX][Footer]
+ * [Header][Next ptr][Prev ptr][Left ptr][Right ptr][Label][Prio][Footer]
  *
  * And organized in BST as:
  *
@@ -63,6 +63,28 @@
  * a left child, right child, root of a tree, or a node in segregated list,
  * repectively.
  *
+ * The BST is a treap: besides the size order, every tree node has a random
+ * priority (a hash of its offset) no larger than its parent's, restored by
+ * rotations on insertion and deletion. The tree shape therefore does not
+ * depend on the order blocks are freed in, and stays O(log n) deep even when
+ * sizes come in increasing or decreasing order.
+ *
+ * The layout above is the default one of util/sizeclass.h, which declares
+ * the bins as a list of size classes: exact lists, range lists searched
+ * first fit, and trees, each up to a size. The bin counts, the threshold
+ * and the entrances in the prologue all follow from it at compile time.
+ * A bin is found by size for exact lists, and by counting the classes
+ * below the size for the others. util/mmspec.c derives a layout from the
+ * sizes of recorded traces or snapshots.
+ *
+ * Built with -DTLSF, blocks larger than the threshold are instead indexed by
+ * two-level segregated fit: a list per power of two, split linearly into 16
+ * classes, with a bitmap of non-empty classes per level. The request is
+ * rounded up to the next class, and the first non-empty class at or above it
+ * is found with two find-first-set operations, so FindFit and the insertion
+ * and deletion of large blocks take constant time. The bitmaps and list heads
+ * follow the bin entrances in the prologue.
+ *
  *
  * Minor:
  * For allocated block, it doesn't have a footer, and I include the allocated
@@ -71,26 +93,132 @@
  * last bit indicates the previous block is allocated or not. For this reason,
  * the minimum block size is 2 * DSIZE = 16 bytes.
  *
+ * The third bit of a free block's header and footer is set when all of the
+ * block past its links (the first six words) and before its footer is known
+ * to be zero: space fresh from sbrk or purged. Splitting keeps the bit, and
+ * coalescing two such blocks clears the words between them, so that calloc
+ * only has to clear the links and footer of the block it is given.
+ *
  * For the ptr shown above, it is actually an offset to the heap_listp, because
  * the heap never exceeds 2^32 so the offset is always a 4 bytes positive int. 
+ * Built with -DLARGEHEAP, offsets count 8-byte granules instead, so the heap
+ * may reach 32GB with the same layout. Block sizes still fit in a header
+ * word, so a chunk never grows past 4GB; larger requests are mmapped.
  *
  * If we find a same size block in BST, we prefer to return the same-size block
  * next to it in its following list, because it will save some unnecessary
  * linking jobs.
  *
+ * Threads:
+ * The heap is split into arenas, one per processor. Each arena has its own
+ * storage structure and lock, and grows by chunks: runs of blocks fenced by
+ * their own prologue and epilogue, so that blocks never coalesce across
+ * arenas. The first chunk of an arena holds its entrances in the prologue as
+ * shown above, and every prologue records the arena owning the chunk:
+ *
+ * [padding][prologue H][arena No.][Seglist 0]...[BST 2][blocks]..[epilogue]
+ * [padding][prologue H][arena No.][blocks]..[epilogue]
+ *
+ * Threads are assigned to arenas round-robin, and a freed block is routed
+ * back to its owner through a table of chunk offsets. A chunk keeps growing
+ * in place while its arena is the last one to have extended the heap.
+ *
+ * Objects of at most 40 bytes are not blocks: they live in slab runs, page
+ * aligned blocks carved into slots of one size. Slots have no header; the
+ * slot size sits in a header at the start of the page, a bitmap marks the
+ * heap pages that are runs, and freed slots are linked through their first
+ * word. Every arena keeps a list of runs with free slots per slot size.
+ *
+ * Requests of 1MB or more (see mm_mallopt) bypass the heap: each one gets an
+ * anonymous mapping of its own, unmapped on free and resized by mremap in
+ * realloc, so that huge buffers neither leave holes in the heap nor get
+ * copied when they grow. A pointer outside the heap is such a chunk, and
+ * its mapping length is kept right before the payload.
+ *
+ * The heap grows by steps: a miss extends an arena by the shortfall of its
+ * trailing free block, but by no less than its growth step, which doubles
+ * during warmup (up to 1MB) and shrinks once blocks get reused. mm_stats
+ * counts the extensions, along with what every arena keeps up to date as
+ * it goes: free blocks and bytes per bin, search and coalescing outcomes,
+ * and the deepest BST insertion. mm_reserve pays for the warmup at once:
+ * it grows an arena to end with a free block of the given size, faults its
+ * pages in if asked to, and the heap is never trimmed below it.
+ *
+ * Freed memory goes back to the system in two ways. When a free block of
+ * 128KB or more ends the heap, the heap is shrunk to keep only 64KB of it;
+ * this works for the arena that grew the heap last. And the whole pages
+ * inside a large free block can be purged: they stay mapped, but lose
+ * their contents and read as zero afterwards. Only the header, links and
+ * footer of the block survive. mm_trim does both over every arena, and
+ * mm_mallopt can make free purge large blocks right away.
+ *
+ * Built with -DHUGEPAGE, memlib backs the heap with 2MB pages when it can.
+ * The heap is then trimmed and purged in whole huge pages, and a purged
+ * block is only marked zero if its edges are cheap to clear.
+ *
+ * In front of the arenas every thread keeps a small cache: one bounded stack
+ * per slot or block size from 16 to 64 bytes. Cached blocks keep their
+ * allocated bit, so they are never coalesced, and they are linked through
+ * their Next ptr.
+ * A malloc/free of those sizes is served by the cache without any lock;
+ * the cache is refilled and flushed in batches, and flushed on thread exit.
+ *
+ * Behind the cache, the free of a block of up to 1KB is deferred: the block
+ * goes on its arena's quick list of its size, still marked allocated, and a
+ * malloc of that size takes it back as it is. Coalescing and insertion into
+ * the bins only run, for every deferred block at once, when a search misses
+ * or when the arena defers more than 64KB (see mm_mallopt).
+ *
+ * A thread freeing a block of another thread's arena does not take its
+ * lock: it pushes the block, still allocated, on the arena's remote stack
+ * with a compare-and-swap. The next malloc from that arena takes the whole
+ * stack with one exchange and frees the blocks under the lock it holds.
+ *
+ * Slots flushed from thread caches are not freed into their runs either,
+ * but shared: every arena keeps a lock-free stack of slots per class, up to
+ * 256, whose head word packs the offset of the top with a tag bumped on each
+ * change, so that a 64-bit compare-and-swap catches a top popped and pushed
+ * back meanwhile. An empty cache refills from it, and the arena lock is only
+ * taken when it runs dry, to carve slots from the runs, or overflows.
+ *
+ * memalign and friends take the first payload of the requested alignment
+ * in a free block, and put the slack in front of it back into the bins as
+ * a block of its own, so nothing is padded. A best fit of the plain size is
+ * tried first, then a block large enough for any slack.
+ *
+ * mm_malloc_batch serves many objects of one size with a single search:
+ * the blocks are carved side by side out of one free block. mm_free_batch
+ * sorts the pointers, and frees each run of neighbouring blocks as a whole.
+ *
+ * A sampling heap profiler, off by default, takes the call stack of about
+ * one allocation per MM_PROFILE_RATE bytes, at points drawn as a Poisson
+ * process over the bytes allocated. Unsampled calls only count down their
+ * bytes, and free looks up an address only if a filter of the sampled ones
+ * has it. Live and allocated samples per stack are dumped for pprof.
+ *
  * 
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <execinfo.h>
+#include <sys/mman.h>
 #include "contracts.h"
 
 #include "mm.h"
 #include "memlib.h"
+#include "snapshot.h"
 
 
 // Create aliases for driver tests
@@ -100,6 +228,13 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define memalign mm_memalign
+#define valloc mm_valloc
+#define pvalloc mm_pvalloc
+#define reallocarray mm_reallocarray
+#define malloc_usable_size mm_malloc_usable_size
 #endif
 
 /*
@@ -107,12 +242,15 @@
  *  -----------------
  *  - dbg_printf acts like printf, but will not be run in a release build.
  *  - checkheap acts like mm_checkheap, but prints the line it failed 
- *  - on and exits if it fails.
+ *  - on and exits if it fails. To keep debug runs linear, it only
+ *  - checks the blocks touched since the last check, and the whole
+ *  - arena one check in MM_CHECK_RATE (see mm_mallopt).
  */
 
 #ifndef NDEBUG
+static int checkStep(void);
 #define dbg_printf(...) printf(__VA_ARGS__)
-#define checkheap(verbose) do {if (mm_checkheap(verbose)) {  \
+#define checkheap(verbose) do {if (checkStep()) {  \
                     printf("Checkheap failed on line %d\n", __LINE__);\
                     exit(-1);  \
                     }}while(0)
@@ -124,21 +262,208 @@
 
 #define WSIZE 4
 #define DSIZE 8
-#define CHUNKSIZE (1<<6) /* Chunk size that every time extend heap */
+#define CHUNKSIZE (1<<6) /* Least heap extension, the first growth step */
 #define MAXCHUNK 0xFFFFFFFF /* Maximum allocated chunk size */
 #define ROOT 0   /* Label Tag: A free block is root */
 #define RIGHT 1  /* A free block is a left child */
 #define LEFT 2  /* A free block is a right child */
 #define SEGNODE 3 /* A free block is a seg node */
+#define ZEROBIT 0x4 /* A free block is zero past its links */
+
+/* The bins follow the size classes of sizeclass.h: first the */
+/* lists, exact ones then ranges, then the trees */
+#define SEGNUM (MM_SC_LISTS - 1) /* Last segregated list */
+#define MAXBINNUM (MM_SC_NUM - 1) /* Last bin */
+#define EXACTNUM MM_SC_EXACTS /* Exact list number */
+#define BLKTHRES MM_SC_LISTMAX /* Block threshold */
+
+#if EXACTNUM > 0 && MM_SC_EXACTMAX != DSIZE * (EXACTNUM + 1)
+#error "Exact size classes must be 16, 24, 32 ... bytes, before the others"
+#endif
+#if BLKTHRES < 24
+#error "Size classes must keep blocks of 16 and 24 bytes in lists"
+#endif
+#if MM_SC_NUM <= MM_SC_LISTS || MM_SC_MAX != 0xFFFFFFFF
+#error "The last size class must be a tree up to 0xFFFFFFFF"
+#endif
+#if MAXBINNUM >= SNAP_NOBIN
+#error "Too many size classes for heap snapshots"
+#endif
+
+#define FLNUM 32 /* TLSF first-level classes, one per power of two */
+#define SLLOG 4 /* Log2 of TLSF second-level subdivisions */
+#define SLNUM (1<<SLLOG) /* TLSF second-level subdivisions */
+
+/* Links are 32 bit offsets from heap_listp in units of OFFSCALE */
+/* bytes. Built with -DLARGEHEAP they count 8-byte granules, so the */
+/* heap may span 32GB; the entrances, which links point to as well, */
+/* are then spaced and placed 8-byte aligned */
+#ifdef LARGEHEAP
+#define OFFSCALE DSIZE
+#define BINSTRIDE DSIZE /* Space taken by an entrance */
+#define ROOTOFF DSIZE /* Structure offset in the prologue */
+#else
+#define OFFSCALE 1
+#define BINSTRIDE WSIZE
+#define ROOTOFF WSIZE
+#endif
+
+/* Size of the storage structure in the prologue: the bin entrances, */
+/* then for TLSF the first-level bitmap, a padding word, the */
+/* second-level bitmaps and the list heads */
+#ifdef TLSF
+#define STRUCTSIZE ((MAXBINNUM + 1 + FLNUM * SLNUM) * BINSTRIDE + \
+                    (2 + FLNUM) * WSIZE)
+#else
+#define STRUCTSIZE ((MAXBINNUM + 1) * BINSTRIDE)
+#endif
 
-#define SEGNUM 3 /* Segregated list number */
-#define MAXBINNUM 5 /* Total bin numer */
-#define BLKTHRES 40 /* Block threshold */
+/* Size of the first prologue of an arena, holding the structure */
+#define PROLOGSIZE (DSIZE * ((ROOTOFF + STRUCTSIZE + WSIZE + DSIZE - 1) / DSIZE))
 
+#define CACHEMAX 64 /* Largest block size kept in thread caches */
+#define CACHENUM (CACHEMAX / DSIZE - 1) /* Thread cache class number */
+#define CACHEDEPTH 32 /* Maximum blocks per thread cache class */
+#define CACHEBATCH 16 /* Blocks moved per refill or flush */
+
+#define HEAPREACH ((1UL<<32) * OFFSCALE) /* Heap span offsets reach */
+
+#define MAXARENA 64 /* Maximum arena number */
+#define ARENACHUNK (1<<16) /* Minimum size of a new arena chunk */
+#define MAXCHUNKNUM (HEAPREACH / ARENACHUNK + MAXARENA) /* Chunk table */
+
+#define SLABMAX 40 /* Largest object kept in slabs */
+#define SLABNUM (SLABMAX / DSIZE - 1) /* Slab class number */
+#define SLABPAGE (1<<12) /* Size and alignment of a slab run */
+#define SLABHDR 24 /* Run header size, where the first slot starts */
+#define DEPOTMAX 256 /* Slots per class an arena shares lock-free */
+
+#define MMAPTHRES (1<<20) /* Default size served by mmap directly */
+#define MMAPHDR 16 /* Header size of a mapped chunk */
+#define MMAPMAGIC 0x6d6d6170UL /* Tag of a mapped chunk header */
+
+#define TRIMTHRES (1<<17) /* Default free top size that gets trimmed */
+#define TOPPAD (1<<16) /* Default free top size kept by trimming */
+
+#define BATCHMAX (1<<18) /* Largest block carved up by one batch */
+
+#define QUICKMAX 1024 /* Largest block size whose free is deferred */
+#define QUICKNUM ((QUICKMAX - CACHEMAX) / DSIZE) /* Quick list number */
+#define QUICKBYTES (1<<16) /* Default bytes an arena defers at most */
+
+#define GROWMAX (1<<20) /* Default cap of the heap growth step */
+
+#define TOUCHMAX 64 /* Blocks a debug build remembers between checks */
+#define CHECKRATE (1<<10) /* Default rate of full debug heap checks */
+
+#define PROFDEPTH 32 /* Frames kept of a sampled call stack */
+#define PROFSTACKS (1<<12) /* Room for distinct sampled call stacks */
+#define PROFOBJS (1<<16) /* Room for live sampled objects */
+#define PROFFILTER (1<<16) /* Slots of the filter of sampled addresses */
+#define PROFBUF 4096 /* Buffer of the profile writer */
+
+#define SNAPBUF 512 /* Records of a heap snapshot written at once */
+
+
+/* An arena is an independent heap: its own bin table, lock and */
+/* chunks. A chunk is a run of blocks fenced by its own prologue */
+/* and epilogue, so blocks never coalesce across arenas */
+typedef struct {
+    pthread_mutex_t lock;   /* Guards every free block of the arena */
+    void *Root;             /* Entrance of its storage structure */
+    char *Base;             /* Start of its last chunk */
+    char *Brk;              /* End of its last chunk */
+    size_t Grow;            /* Least size of the next heap extension */
+    size_t Since;           /* Bytes allocated since the last one */
+    char *Keep;             /* Reserved heap top, never trimmed */
+    size_t Heap;            /* Bytes of blocks in its chunks */
+    mm_stats_t St;          /* Its free space and search counters */
+    unsigned int Slab[SLABNUM]; /* Runs with free slots, per class */
+    unsigned int Quick[QUICKNUM]; /* Freed blocks not coalesced yet, per size */
+    size_t Deferred;        /* ... and their bytes */
+    unsigned int Remote;    /* Blocks other threads freed, taken lock-free */
+    uint64_t Depot[SLABNUM]; /* Freed slots shared lock-free, per class: */
+                            /* the top offset, and an ABA tag above it */
+    unsigned int DepotNum[SLABNUM]; /* ... and about how many */
+#ifndef NDEBUG
+    unsigned int Touched[TOUCHMAX]; /* Blocks changed since the last check */
+    unsigned int TouchNum;  /* ... their number, TOUCHMAX + 1 if some were lost */
+    unsigned long Checks;   /* Heap checks so far */
+#endif
+} Arena;
+
+/* A slab run is a page-aligned allocated block, carved into slots */
+/* of one size without headers. The class is kept in the run header */
+/* at the start of the page, and the slots are linked through their */
+/* first word once freed. Slots never used are handed out by bump */
+typedef struct {
+    unsigned int next;      /* Next run of the class with free slots */
+    unsigned int prev;      /* Previous run, 0 if first in the arena */
+    unsigned int free;      /* First freed slot */
+    unsigned short size;    /* Slot size */
+    unsigned short used;    /* Slots handed out */
+    unsigned short bump;    /* Page offset of the first never used slot */
+} SlabRun;
 
 
 char *heap_listp;
-void *Root; /* pointer to the entrace of storage structure */
+static Arena Arenas[MAXARENA];
+static unsigned int ArenaNum;   /* Arenas threads are spread over */
+static unsigned int NextArena;  /* Round-robin arena assignment */
+
+/* Arena whose lock the calling thread holds, the block */
+/* functions below work on its storage structure */
+static __thread Arena *CurArena;
+
+/* Offsets of every chunk prologue in address order, so that a */
+/* block can be routed back to the arena that owns it */
+static unsigned int ChunkTab[MAXCHUNKNUM];
+static unsigned int ChunkNum;
+
+/* One bit per heap page, set for the pages that are slab runs */
+static unsigned char SlabMap[HEAPREACH / SLABPAGE / 8];
+
+/* Requests of at least this size are mmapped, see mm_mallopt */
+static size_t MmapThres = MMAPTHRES;
+
+/* Trimming and purging of free space, see mm_mallopt */
+static size_t TrimThres = TRIMTHRES;
+static size_t TopPad = TOPPAD;
+static size_t PurgeThres = 0;
+
+/* Freed bytes an arena defers coalescing of, see mm_mallopt */
+static size_t QuickBytes = QUICKBYTES;
+
+/* Cap of the heap growth step, see mm_mallopt */
+static size_t GrowMax = GROWMAX;
+
+/* One debug heap check in this many is full, see mm_mallopt */
+static size_t CheckRate = CHECKRATE;
+
+/* Heap growth counters, guarded by the sbrk lock */
+static mm_stats_t Growth;
+
+/* Bytes in mapped chunks, updated atomically */
+static size_t MapBytes;
+
+/* Guards mem_sbrk and the chunk table */
+static pthread_mutex_t SbrkLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bumped by mm_init, so that caches holding an old heap are dropped */
+static unsigned long HeapEpoch;
+
+/* Per-thread cache: a stack of allocated blocks for each size */
+typedef struct {
+    unsigned int head[CACHENUM];   /* Offset of the top block */
+    unsigned int count[CACHENUM];  /* Blocks in the stack */
+    unsigned long epoch;           /* HeapEpoch the stacks belong to */
+    Arena *arena;                  /* Arena the thread allocates from */
+    int dead;                      /* Released, the thread is exiting */
+} ThreadCache;
+
+static __thread ThreadCache Cache;
+static pthread_key_t CacheKey;
+static pthread_once_t CacheKeyOnce = PTHREAD_ONCE_INIT;
 
 
 /*
@@ -147,7 +472,7 @@ void *Root; /* pointer to the entrace of storage structure */
  *  --------------------------------------
  */
 
-static inline int Max(int x, int y){
+static inline size_t Max(size_t x, size_t y){
     if(x > y) return x;
     return y;
 }
@@ -162,12 +487,12 @@ static inline size_t Get(void *p){
     return (*(unsigned int *)(p));
 }
 
-static inline void Put(void *p, int val){
+static inline void Put(void *p, size_t val){
     (*(unsigned int *)(p)) = val;
 }
 
 /* Write a word at address p, while keeping the PrevAlloc bit */
-static inline void PutLabel(void *p, int val){
+static inline void PutLabel(void *p, size_t val){
     unsigned int temp = ((*(unsigned int *)(p)) & 0x2);
     (*(unsigned int *)(p)) = (val | temp);
 }
@@ -187,6 +512,11 @@ static inline void *FTRP(void *bp){
     return (void *)((char *)(bp) + GetSize(HDRP(bp)) - DSIZE);
 }
 
+/* Return ZEROBIT if the free block bp is zero past its links */
+static inline int GetZero(void *bp){
+    return (Get(HDRP(bp)) & ZEROBIT);
+}
+
 /* Read the allocated fields from address p */
 static inline int GetAlloc(void *p){
     return (Get(HDRP(p)) & 0x1);
@@ -239,12 +569,17 @@ static inline void *RightPtr(void *bp){
     return (void *)((char *)(bp) + 3 * WSIZE);
 }
 
+/* Given a pointer to a block, return the ptr to its Prio field */
+static inline void *PrioPtr(void *bp){
+    return (void *)((char *)(bp) + 5 * WSIZE);
+}
+
 /* Given a pointer, if it is NULL, return 0; if non-null */
 /* return the offset to heap_listp, so that it is a 32 bit word */
 static inline unsigned int PtrToInt(void *ptr){
     if(ptr == NULL) return 0;
-    return (unsigned int)((unsigned long)ptr -
-                          (unsigned long)heap_listp);
+    return (unsigned int)(((unsigned long)ptr -
+                           (unsigned long)heap_listp) / OFFSCALE);
 }
 
 
@@ -252,7 +587,8 @@ static inline unsigned int PtrToInt(void *ptr){
 /* return (offset + heap_listp), so that it is a 64 bit pointer */
 static inline void *IntToPtr(unsigned int val){
     if(val == 0) return NULL;
-    return (void *)((unsigned long)val + (unsigned long)heap_listp);
+    return (void *)((unsigned long)val * OFFSCALE +
+                    (unsigned long)heap_listp);
 }
 
 
@@ -292,22 +628,108 @@ static inline void SetNextHDR(void *bp){
 }
 
 
+/* Largest block size of every bin, from the size classes, and */
+/* its kind: 0 exact, 1 range, 2 tree. The kinds are only read by */
+/* the heap checker, the code tells them apart by index */
+#define BinMaxOf(s) (s),
+#define BinKindOf0(s) 0,
+#define BinKindOf1(s) 1,
+#define BinKindOf2(s) 2,
+static const unsigned int BinMax[] =
+    {MM_SIZECLASSES(BinMaxOf, BinMaxOf, BinMaxOf)};
+static const unsigned char BinKind[] __attribute__((unused)) =
+    {MM_SIZECLASSES(BinKindOf0, BinKindOf1, BinKindOf2)};
+
 /* Give the adjusted size of a block, return the bin index */
-/* it belongs to */
+/* it belongs to: the count of bins below it, without a branch. */
+/* The last bin ends at 0xFFFFFFFF, so every block has one */
+#define BinBelow(s) + (asize > (s))
 static inline size_t GetBinInd(size_t asize){
-    if(asize == 16) return 0;
-    if(asize == 24) return 1;
-    if(asize == 32) return 2;
-    if(asize == 40) return 3;
-    if(40 < asize && asize <= 64) return 4;
-    return 5;
+    return 0 MM_SIZECLASSES(BinBelow, BinBelow, BinBelow);
 }
 
 /* Give the bin index, get the address of the bin */
 static inline void *GetBinAdd(size_t binNum){
-    return (void *)((char *)Root + binNum * WSIZE);
+    return (void *)((char *)CurArena->Root + binNum * BINSTRIDE);
+}
+
+/* Count a free block of asize bytes entering (in = 1) or */
+/* leaving (in = 0) the bins of the current arena */
+static inline void BinCount(size_t asize, int in){
+    size_t binNum = GetBinInd(asize);
+    if(in){
+        CurArena->St.bin_count[binNum]++;
+        CurArena->St.bin_bytes[binNum] += asize;
+    }
+    else{
+        CurArena->St.bin_count[binNum]--;
+        CurArena->St.bin_bytes[binNum] -= asize;
+    }
+}
+
+/* Count the outcome of a search for asize bytes, return bp */
+static inline void *FitCount(void *bp, size_t asize){
+    if(bp == NULL) CurArena->St.fit_miss++;
+    else if(GetSize(HDRP(bp)) == asize) CurArena->St.fit_exact++;
+    else CurArena->St.fit_closest++;
+    return bp;
+}
+
+/* Tell whether a free list link points at a bin entrance of the */
+/* current arena rather than at a block */
+static inline int IsEntrance(void *p){
+    return (char *)p >= (char *)CurArena->Root &&
+           (char *)p < (char *)CurArena->Root + STRUCTSIZE;
+}
+
+#ifndef NDEBUG
+/* Remember a block whose header or links changed, for the next */
+/* heap check. Once more than TOUCHMAX are, that check is full */
+static inline void Touch(void *bp){
+    Arena *a = CurArena;
+    unsigned int i;
+    
+    if(bp == NULL || IsEntrance(bp) || a->TouchNum > TOUCHMAX) return;
+    for(i = 0; i < a->TouchNum; i++){
+        if(a->Touched[i] == PtrToInt(bp)) return;
+    }
+    if(a->TouchNum < TOUCHMAX) a->Touched[a->TouchNum] = PtrToInt(bp);
+    a->TouchNum++;
+}
+
+/* Forget a block merged into its predecessor, which is no longer */
+/* a block of its own */
+static inline void Untouch(void *bp){
+    Arena *a = CurArena;
+    unsigned int i = 0;
+    
+    if(a->TouchNum > TOUCHMAX) return;
+    while(i < a->TouchNum){
+        if(a->Touched[i] == PtrToInt(bp)){
+            a->Touched[i] = a->Touched[--a->TouchNum];
+        }
+        else i++;
+    }
 }
 
+/* Remember the free blocks linked to bp, whose links change when */
+/* it leaves its bin */
+static inline void TouchLinks(void *bp){
+    Touch(PrevFreed(bp));
+    Touch(NextFreed(bp));
+#ifndef TLSF
+    if(GetSize(HDRP(bp)) > BLKTHRES && Get(LabelPtr(bp)) != SEGNODE){
+        Touch(LeftFreed(bp));
+        Touch(RightFreed(bp));
+    }
+#endif
+}
+#else
+#define Touch(bp)
+#define Untouch(bp)
+#define TouchLinks(bp)
+#endif
+
 
 /* The next two funcions re-link the block bp and */
 /* its parent in BST, it will link the downward pointer */
@@ -344,6 +766,56 @@ static inline void ChangeLinkToNull(void *bp){
 
 
 
+/* Give a tree node its treap priority: a hash of its offset, so */
+/* that the tree shape does not depend on the order of sizes */
+static inline unsigned int Priority(void *bp){
+    unsigned int x = PtrToInt(bp);
+    x = ((x >> 16) ^ x) * 0x45d9f3b;
+    x = ((x >> 16) ^ x) * 0x45d9f3b;
+    return (x >> 16) ^ x;
+}
+
+
+/* Rotate a tree node up, above its parent. The parent becomes */
+/* its child and takes over the subtree between the two */
+static inline void RotateUp(void *bp){
+    void *parent = PrevFreed(bp);
+    void *temp;
+    
+    ENSURES(Get(LabelPtr(bp)) == LEFT || Get(LabelPtr(bp)) == RIGHT);
+    Touch(PrevFreed(parent));
+    Touch(parent);
+    
+    if(Get(LabelPtr(bp)) == LEFT){
+        temp = RightFreed(bp);
+        Put(LeftPtr(parent), PtrToInt(temp));
+        if(temp != NULL){
+            Put(PrevPtr(temp), PtrToInt(parent));
+            Put(LabelPtr(temp), LEFT);
+        }
+        Put(RightPtr(bp), PtrToInt(parent));
+        ChangeLink(parent, bp);
+        Put(PrevPtr(bp), Get(PrevPtr(parent)));
+        Put(LabelPtr(parent), RIGHT);
+    }
+    else{
+        temp = LeftFreed(bp);
+        Put(RightPtr(parent), PtrToInt(temp));
+        if(temp != NULL){
+            Put(PrevPtr(temp), PtrToInt(parent));
+            Put(LabelPtr(temp), RIGHT);
+        }
+        Put(LeftPtr(bp), PtrToInt(parent));
+        ChangeLink(parent, bp);
+        Put(PrevPtr(bp), Get(PrevPtr(parent)));
+        Put(LabelPtr(parent), LEFT);
+    }
+    Put(PrevPtr(parent), PtrToInt(bp));
+    Touch(temp);
+}
+
+
+
 /*
  * -----------------------------------
  *  Block Functions start from here
@@ -385,9 +857,12 @@ void DlistInsert(void *bp, size_t asize){
 
 
 /* Recursion helper function that insert a block into BST */
-void TreeInsertRecur(void *bp, void *Entry){
+/* Entry is at the given depth, the root being at depth 1 */
+void TreeInsertRecur(void *bp, void *Entry, unsigned long depth){
     
-    int diff = GetSize(HDRP(bp)) - GetSize(HDRP(Entry));
+    size_t size = GetSize(HDRP(bp));
+    size_t esize = GetSize(HDRP(Entry));
+    int diff = (size > esize) - (size < esize);
     
     /* Find the same size block, insert the segregated list */
     /* following it */
@@ -406,16 +881,19 @@ void TreeInsertRecur(void *bp, void *Entry){
     
     /* Go to right branch */
     if(diff > 0 && RightFreed(Entry) != NULL){
-        TreeInsertRecur(bp, RightFreed(Entry));
+        TreeInsertRecur(bp, RightFreed(Entry), depth + 1);
     }
     
     /* Go to left branch */
     else if(diff < 0 && LeftFreed(Entry) != NULL){
-        TreeInsertRecur(bp, LeftFreed(Entry));
+        TreeInsertRecur(bp, LeftFreed(Entry), depth + 1);
     }
     
     /* Can not find a block with same size, insert tree node */
     else{
+        if(depth + 1 > CurArena->St.tree_depth){
+            CurArena->St.tree_depth = depth + 1;
+        }
         Put(RightPtr(bp), PtrToInt(NULL));
         Put(LeftPtr(bp), PtrToInt(NULL));
         Put(NextPtr(bp), PtrToInt(NULL));
@@ -434,6 +912,14 @@ void TreeInsertRecur(void *bp, void *Entry){
             Put(LeftPtr(Entry), PtrToInt(bp));
             Put(LabelPtr(bp), LEFT);
         }
+        
+        /* Restore the heap order of priorities, which keeps the */
+        /* tree balanced whatever order the sizes come in */
+        Put(PrioPtr(bp), Priority(bp));
+        while(Get(LabelPtr(bp)) != ROOT &&
+              Get(PrioPtr(PrevFreed(bp))) < Get(PrioPtr(bp))){
+            RotateUp(bp);
+        }
     }    
 }
 
@@ -456,13 +942,71 @@ void TreeInsert(void *bp, size_t asize){
         Put(NextPtr(bp), PtrToInt(NULL));
         Put(NextPtr(BinAdd), PtrToInt(bp));
         Put(LabelPtr(bp), ROOT);
+        Put(PrioPtr(bp), Priority(bp));
+        if(CurArena->St.tree_depth == 0){
+            CurArena->St.tree_depth = 1;
+        }
         REQUIRES(IntToPtr(Get(BinAdd)) != NULL);
         dbg_printf("Inserting tree root\n");
     }
     
     /* Go to tree node insertion step */
-    else TreeInsertRecur(bp, Entry);
+    else TreeInsertRecur(bp, Entry, 1);
+    
+}
+
+
+/* The following functions keep blocks larger than the threshold */
+/* in a two-level segregated fit (TLSF) index, an alternative to the */
+/* BSTs: the first level splits sizes by power of two, the second */
+/* splits each power of two linearly in SLNUM classes. Each class */
+/* is a doubly linked list like a segregated list, and two levels */
+/* of bitmaps tell which lists are non-empty */
+
+/* Return the address of the first-level bitmap */
+static inline void *TlsfFlMap(void){
+    return (void *)((char *)CurArena->Root + (MAXBINNUM + 1) * BINSTRIDE);
+}
+
+/* Return the address of the second-level bitmap of class fl */
+static inline void *TlsfSlMap(size_t fl){
+    return (void *)((char *)TlsfFlMap() + (2 + fl) * WSIZE);
+}
+
+/* Return the address of the list head of class (fl, sl) */
+static inline void *TlsfHead(size_t fl, size_t sl){
+    return (void *)((char *)TlsfFlMap() + (2 + FLNUM) * WSIZE +
+                    (fl * SLNUM + sl) * BINSTRIDE);
+}
+
+/* Give the size of a block, return its first and second level */
+static inline size_t TlsfFl(size_t asize){
+    return (8 * sizeof(long) - 1) - __builtin_clzl(asize);
+}
+
+static inline size_t TlsfSl(size_t asize, size_t fl){
+    return (asize >> (fl - SLLOG)) & (SLNUM - 1);
+}
+
+
+/* Insert a freed block at the head of its TLSF list */
+void TlsfInsert(void *bp, size_t asize){
+    dbg_printf("TLSF insertion\n");
+    
+    size_t fl = TlsfFl(asize);
+    size_t sl = TlsfSl(asize, fl);
+    void *Head = TlsfHead(fl, sl);
+    void *Entry = IntToPtr(Get(Head));
+    
+    Put(NextPtr(bp), PtrToInt(Entry));
+    Put(PrevPtr(bp), PtrToInt(Head));
+    if(Entry != NULL){
+        Put(PrevPtr(Entry), PtrToInt(bp));
+    }
+    Put(NextPtr(Head), PtrToInt(bp));
     
+    Put(TlsfSlMap(fl), Get(TlsfSlMap(fl)) | (1U << sl));
+    Put(TlsfFlMap(), Get(TlsfFlMap()) | (1U << fl));
 }
 
 
@@ -474,8 +1018,14 @@ void InsertBlock(void *bp, size_t asize){
     dbg_printf("Inserting block with size %zu\n",
                GetSize(HDRP(bp)));
 
+    BinCount(asize, 1);
     if(asize <= BLKTHRES) DlistInsert(bp, asize);
+#ifdef TLSF
+    else TlsfInsert(bp, asize);
+#else
     else TreeInsert(bp, asize);
+#endif
+    Touch(bp);
 
 }
 
@@ -512,11 +1062,12 @@ void TreeDelete(void *bp){
     /* Same as doubly list deletion */
     if(Get(LabelPtr(bp)) == SEGNODE){
         DlistDelete(bp);
+        return;
     }
     
     /* Deleting a node in tree which has following list */
     /* Shift the following list */
-    else if(NextFreed(bp) != NULL){
+    if(NextFreed(bp) != NULL){
         temp = NextFreed(bp);
         ENSURES(Get(LabelPtr(bp)) != SEGNODE);
         if(RightFreed(bp) != NULL){
@@ -528,54 +1079,27 @@ void TreeDelete(void *bp){
         Put(LeftPtr(temp), Get(LeftPtr(bp)));
         Put(RightPtr(temp), Get(RightPtr(bp)));
         Put(PrevPtr(temp), Get(PrevPtr(bp)));
+        Put(PrioPtr(temp), Get(PrioPtr(bp)));
         ChangeLink(bp, temp);
+        return;
     }
     
-    
     /* Deleting a node in tree that has no following list */
-    /* Delete the whole node from BST */
-    else if(LeftFreed(bp) != NULL && RightFreed(bp) != NULL){
-        ENSURES(NextFreed(bp) == NULL);
-        ENSURES(Get(LabelPtr(bp)) != SEGNODE);
+    /* Rotate it down until it has at most one child, keeping */
+    /* the heap order of priorities */
+    while(LeftFreed(bp) != NULL && RightFreed(bp) != NULL){
         dbg_printf("This node has left and right---");
-        temp = RightFreed(bp);
-        ENSURES(temp != NULL);
-        
-        /* If right child doesn't have left child */
-        if(LeftFreed(temp) == NULL){
-            dbg_printf("This node's right have no left---");
-            Put(PrevPtr(temp), Get(PrevPtr(bp)));
-            Put(LeftPtr(temp), Get(LeftPtr(bp)));
-            Put(PrevPtr(LeftFreed(bp)), Get(RightPtr(bp)));
-            ChangeLink(bp, temp);
+        if(Get(PrioPtr(LeftFreed(bp))) > Get(PrioPtr(RightFreed(bp)))){
+            RotateUp(LeftFreed(bp));
         }
-        
-        /* If right child has left child, find the leftmost node */
-        /* to replace the deleted node */
         else{
-            dbg_printf("This node's right have left---");
-            while(LeftFreed(temp) != NULL){
-                temp = LeftFreed(temp);
-            }
-            ENSURES(LeftFreed(temp) == NULL);
-            
-            if(RightFreed(temp) != NULL){
-                REQUIRES(Get(LabelPtr(RightFreed(temp))) == RIGHT);
-                Put(PrevPtr(RightFreed(temp)), Get(PrevPtr(temp)));
-                Put(LabelPtr(RightFreed(temp)), LEFT);
-            }
-            Put(LeftPtr(PrevFreed(temp)), Get(RightPtr(temp)));
-            Put(PrevPtr(temp), Get(PrevPtr(bp)));
-            Put(LeftPtr(temp), Get(LeftPtr(bp)));
-            Put(RightPtr(temp), Get(RightPtr(bp)));
-            Put(PrevPtr(RightFreed(bp)), PtrToInt(temp));
-            Put(PrevPtr(LeftFreed(bp)), PtrToInt(temp));
-            ChangeLink(bp, temp);
+            RotateUp(RightFreed(bp));
         }
     }
     
+    /* Delete the whole node from BST */
     /* If the deleted node has only left child */
-    else if(LeftFreed(bp) != NULL){
+    if(LeftFreed(bp) != NULL){
         dbg_printf("This node has only left---");
         temp = LeftFreed(bp);
         ChangeLink(bp, temp);
@@ -599,6 +1123,25 @@ void TreeDelete(void *bp){
 }
 
 
+/* Delete a block from its TLSF list, clearing the bitmaps */
+/* when the list becomes empty */
+void TlsfDelete(void *bp){
+    dbg_printf("TLSF deletion\n");
+    
+    size_t asize = GetSize(HDRP(bp));
+    size_t fl = TlsfFl(asize);
+    size_t sl = TlsfSl(asize, fl);
+    
+    DlistDelete(bp);
+    if(Get(TlsfHead(fl, sl)) == 0){
+        Put(TlsfSlMap(fl), Get(TlsfSlMap(fl)) & ~(1U << sl));
+        if(Get(TlsfSlMap(fl)) == 0){
+            Put(TlsfFlMap(), Get(TlsfFlMap()) & ~(1U << fl));
+        }
+    }
+}
+
+
 /* Delete a node from explicit list given a pointer to it */
 /* If the size is less than block threshold, delete it in list */
 /* else, delete it in BST */
@@ -608,9 +1151,34 @@ void DeleteBlock(void *bp){
     
     size_t asize = GetSize(HDRP(bp));
     
+    BinCount(asize, 0);
+    TouchLinks(bp);
     if(asize <= BLKTHRES) DlistDelete(bp);
+#ifdef TLSF
+    else TlsfDelete(bp);
+#else
     else TreeDelete(bp);
+#endif
+
+}
+
 
+/* ZeroSeam: before two adjacent free blocks merge, clear the */
+/* footer of lo and the header and links of up if both are zero */
+/* Return ZEROBIT if the merged block is zero past its links */
+static inline int ZeroSeam(void *lo, void *up){
+    
+    char *end;
+    
+    if(!GetZero(lo) || !GetZero(up)){
+        return 0;
+    }
+    end = (char *)up + 6 * WSIZE;
+    if(end > (char *)FTRP(up)){
+        end = FTRP(up);
+    }
+    memset((char *)up - DSIZE, 0, end - ((char *)up - DSIZE));
+    return ZEROBIT;
 }
 
 
@@ -622,44 +1190,107 @@ static void *coalesce(void *bp){
     size_t prev_alloc = GetPrevAlloc(bp);
     size_t next_alloc = GetNextAlloc(bp);
     size_t size = GetSize(HDRP(bp));
+    void *prev, *next;
+    int zero;
     
     if(prev_alloc && next_alloc){              /* case 1 */
         dbg_printf("Case 1\n");
+        CurArena->St.coalesce[0]++;
         return bp;
     }
     
     else if(prev_alloc && !next_alloc){        /* case 2 */
         dbg_printf("Case 2\n");
-        DeleteBlock(NextBlkp(bp));
-        size += GetSize(HDRP(NextBlkp(bp)));
-        PutLabel(HDRP(bp), Pack(size, 0));
-        PutLabel(FTRP(bp), Pack(size, 0));
+        CurArena->St.coalesce[1]++;
+        next = NextBlkp(bp);
+        DeleteBlock(next);
+        Untouch(next);
+        size += GetSize(HDRP(next));
+        zero = ZeroSeam(bp, next);
     }
 
     else if(!prev_alloc && next_alloc){        /* case 3 */
         dbg_printf("Case 3\n");
-        DeleteBlock(PrevBlkp(bp));
-        size += GetSize(HDRP(PrevBlkp(bp)));
-        PutLabel(FTRP(bp), Pack(size, 0));
-        PutLabel(HDRP(PrevBlkp(bp)), Pack(size, 0));
-        bp = PrevBlkp(bp);
+        CurArena->St.coalesce[2]++;
+        prev = PrevBlkp(bp);
+        DeleteBlock(prev);
+        Untouch(bp);
+        size += GetSize(HDRP(prev));
+        zero = ZeroSeam(prev, bp);
+        bp = prev;
     }
     
     else{                                      /* case 4 */
         dbg_printf("Case 4\n");
-        DeleteBlock(NextBlkp(bp));
-        DeleteBlock(PrevBlkp(bp));
-        size += GetSize(HDRP(PrevBlkp(bp))) +
-                GetSize(FTRP(NextBlkp(bp)));
-        PutLabel(HDRP(PrevBlkp(bp)), Pack(size, 0));
-        PutLabel(FTRP(NextBlkp(bp)), Pack(size, 0));
-        bp = PrevBlkp(bp);
+        CurArena->St.coalesce[3]++;
+        prev = PrevBlkp(bp);
+        next = NextBlkp(bp);
+        DeleteBlock(next);
+        DeleteBlock(prev);
+        Untouch(next);
+        Untouch(bp);
+        size += GetSize(HDRP(prev)) + GetSize(HDRP(next));
+        zero = ZeroSeam(bp, next) ? ZeroSeam(prev, bp) : 0;
+        bp = prev;
     }
     
+    /* The seams are cleared, so the sizes are written last */
+    PutLabel(HDRP(bp), Pack(size, zero));
+    PutLabel(FTRP(bp), Pack(size, zero));
     return bp;
 }
 
 
+/* HeapFits: decide whether the heap can grow by size bytes and */
+/* stay within the reach of offsets. The sbrk lock must be held */
+static inline int HeapFits(size_t size){
+    return (uintptr_t)mem_heap_hi() + 1 + size <=
+           (uintptr_t)heap_listp + HEAPREACH;
+}
+
+
+/* NewChunk: start a chunk at the heap top for the current arena: */
+/* a prologue of psize bytes holding the owner arena index, a free */
+/* block of size bytes (if any) and the epilogue. Return the */
+/* prologue block pointer. The sbrk lock must be held */
+static char *NewChunk(size_t psize, size_t size){
+    
+    char *p;
+    
+    if(ChunkNum == MAXCHUNKNUM || !HeapFits(psize + size + DSIZE)){
+        return NULL;
+    }
+    if((long)(p = mem_sbrk(psize + size + DSIZE)) == -1){
+        return NULL;
+    }
+    Growth.extends++;
+    Growth.chunks++;
+    Growth.grown += psize + size + DSIZE;
+    CurArena->Heap += size;
+    
+    Put(p, 0);                             /* Alignment padding */
+    Put(p + WSIZE, Pack(psize, 1));        /* Prologue header */
+    p += DSIZE;
+    Put(p, CurArena - Arenas);             /* Owner arena */
+    
+    if(size > 0){
+        Put(HDRP(NextBlkp(p)), Pack(size, 0x2 | ZEROBIT));  /* Fresh */
+        PutLabel(FTRP(NextBlkp(p)), Pack(size, ZEROBIT));
+        Put(HDRP(NextBlkp(NextBlkp(p))), Pack(0, 1));  /* Epilogue */
+    }
+    else{
+        Put(HDRP(NextBlkp(p)), Pack(0, 0x3));          /* Epilogue */
+    }
+    CurArena->Base = p;
+    CurArena->Brk = p + psize + size;
+    
+    /* Publish the chunk only once it is laid out */
+    ChunkTab[ChunkNum] = PtrToInt(p);
+    __atomic_store_n(&ChunkNum, ChunkNum + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+
 /* extend_heap: Extend heap with free block */
 /* and return its block pointer */
 static void *extend_heap(size_t words){
@@ -669,15 +1300,37 @@ static void *extend_heap(size_t words){
     
     /* Allocate an even number of words to maintain alignment */
     size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-    if((long)(bp = mem_sbrk(size)) == -1){
+    
+    pthread_mutex_lock(&SbrkLock);
+    
+    /* Another arena has grown the heap since, so the new space */
+    /* is not next to our epilogue, or the chunk would get larger */
+    /* than a block may be: fence it as a new chunk */
+    if((char *)mem_heap_hi() + 1 != CurArena->Brk ||
+       (size_t)(CurArena->Brk - CurArena->Base) + size > MAXCHUNK - DSIZE){
+        size = Max(size, ARENACHUNK);
+        bp = NewChunk(DSIZE, size);
+        pthread_mutex_unlock(&SbrkLock);
+        dbg_printf("extend_heap by new chunk %zu\n", size);
+        return (bp == NULL) ? NULL : NextBlkp(bp);
+    }
+    
+    if(!HeapFits(size) || (long)(bp = mem_sbrk(size)) == -1){
+        pthread_mutex_unlock(&SbrkLock);
         return NULL;
     }
+    CurArena->Brk = bp + size;
+    CurArena->Heap += size;
+    Growth.extends++;
+    Growth.grown += size;
+    pthread_mutex_unlock(&SbrkLock);
     
-    dbg_printf("extend_heap by %d\n", (int)size);
+    dbg_printf("extend_heap by %zu\n", size);
     
     /* Initialize free block header/footer and the epilogue header */
-    PutLabel(HDRP(bp), Pack(size, 0));         /* Free block header */ 
-    PutLabel(FTRP(bp), Pack(size, 0));         /* Free block footer */ 
+    /* The space past the old break is zero */
+    PutLabel(HDRP(bp), Pack(size, ZEROBIT));   /* Free block header */ 
+    PutLabel(FTRP(bp), Pack(size, ZEROBIT));   /* Free block footer */ 
     PutLabel(HDRP(NextBlkp(bp)), Pack(0, 1));  /* New epilogue header */ 
     ResetNextHDR(bp);         /* Its predecessor must be a free block */
     
@@ -686,6 +1339,102 @@ static void *extend_heap(size_t words){
 }
 
 
+/* GrowStep: return how far to extend the current arena for a */
+/* shortfall of need bytes in a block of asize bytes: the growth */
+/* step at least. The step doubles up to a cap while the allocations */
+/* since the last extension stay within a few steps, or within a */
+/* few of the block itself, which always misses when larger than the */
+/* step. That is while they mostly come from new space. It halves */
+/* while they come from free space */
+static size_t GrowStep(size_t need, size_t asize){
+    
+    Arena *a = CurArena;
+    
+    if(need < a->Grow){
+        need = a->Grow;
+    }
+    
+    if(a->Since <= 4 * Max(a->Grow, asize)){
+        a->Grow = (2 * a->Grow < GrowMax) ? 2 * a->Grow : GrowMax;
+    }
+    else if(a->Grow / 2 >= CHUNKSIZE){
+        a->Grow /= 2;
+    }
+    a->Since = 0;
+    return need;
+}
+
+
+/* GrowHeap: extend the current arena for a block of asize bytes */
+/* Only the shortfall of a free block ending the arena is needed, */
+/* but the heap grows by the growth step at least, see GrowStep */
+/* Return the new block */
+static void *GrowHeap(size_t asize){
+    
+    Arena *a = CurArena;
+    size_t need = asize;
+    size_t tail;
+    char *bp;
+    
+    if(!GetPrevAlloc(a->Brk)){
+        tail = GetSize(HDRP(PrevBlkp(a->Brk)));
+        need = (tail < asize) ? asize - tail : 0;
+    }
+    need = GrowStep(need, asize);
+    
+    if((bp = extend_heap(need/WSIZE)) == NULL){
+        return NULL;
+    }
+    
+    /* Another arena took the heap top, the tail was not extended */
+    if(GetSize(HDRP(bp)) < asize){
+        InsertBlock(bp, GetSize(HDRP(bp)));
+        bp = extend_heap(Max(asize, need)/WSIZE);
+    }
+    return bp;
+}
+
+
+/* TlsfFind: return the first block of the smallest non-empty */
+/* TLSF class whose blocks all fit asize, in constant time. The */
+/* request is rounded up to the next class boundary, so that any */
+/* block of the class found is large enough */
+static inline void *TlsfFind(size_t asize){
+    
+    size_t fl, sl;
+    unsigned int map;
+    
+    if(asize <= BLKTHRES){
+        asize = BLKTHRES + DSIZE;
+    }
+    asize += (1UL << (TlsfFl(asize) - SLLOG)) - 1;
+    fl = TlsfFl(asize);
+    sl = TlsfSl(asize, fl);
+    if(fl >= FLNUM){
+        return NULL;
+    }
+    
+    /* Search the rest of the first-level class, then the next */
+    /* non-empty first-level class */
+    map = Get(TlsfSlMap(fl)) & (~0U << sl);
+    if(map == 0){
+        if(fl + 1 >= FLNUM){
+            return NULL;
+        }
+        map = Get(TlsfFlMap()) & (~0U << (fl + 1));
+        if(map == 0){
+            return NULL;
+        }
+        fl = __builtin_ctz(map);
+        map = Get(TlsfSlMap(fl));
+    }
+    sl = __builtin_ctz(map);
+    
+    dbg_printf("Find asize in TLSF class (%zu, %zu)\n", fl, sl);
+    return IntToPtr(Get(TlsfHead(fl, sl)));
+}
+
+
 /* FindFit: first it will decide search in segregated list or */
 /* in BST based on asize. If cannot find in seglist, it will  */
 /* proceed to BST. In BST, it wil find the block with exact the */
@@ -701,16 +1450,33 @@ static inline void *FindFit(size_t asize){
     void *tempAdd;
     unsigned int tempSize;
     
-    /* Segregated list searching */
+    /* Segregated list searching: an exact list only holds asize, */
+    /* a range list is searched for the first block that fits */
     if(binNum <= SEGNUM){
-        if(bp != NULL && asize == GetSize(HDRP(bp))){
+        while(bp != NULL && GetSize(HDRP(bp)) < asize){
+            bp = NextFreed(bp);
+        }
+        if(bp != NULL){
             dbg_printf("Find asize in list = %zu\n", GetSize(HDRP(bp)));
-            return bp;
+            return FitCount(bp, asize);
+        }
+        
+        /* Any block of a later range list fits, exact lists are */
+        /* left for their own size */
+        for(binNum = Max(binNum + 1, EXACTNUM); binNum <= SEGNUM; binNum++){
+            if((bp = IntToPtr(Get(GetBinAdd(binNum)))) != NULL){
+                return FitCount(bp, asize);
+            }
         }
         /* Can not find a free block in segregated list */
-        else binNum = SEGNUM + 1;   /* Go to BST */
+        binNum = SEGNUM + 1;   /* Go to BST */
     }
     
+#ifdef TLSF
+    /* Larger blocks are indexed by TLSF rather than BST */
+    return FitCount(TlsfFind(asize), asize);
+#endif
+    
     /* BST searching */
     while(binNum <= MAXBINNUM){
         
@@ -746,12 +1512,12 @@ static inline void *FindFit(size_t asize){
                 /* It will save some re-linking jobs */
                 if(NextFreed(bp) == NULL){
                     ENSURES(Get(LabelPtr(bp)) != SEGNODE);
-                    return bp;
+                    return FitCount(bp, asize);
                 }
                 else{
                     ENSURES(GetSize(HDRP(bp)) ==
                             GetSize(HDRP(NextFreed(bp))));
-                    return NextFreed(bp);
+                    return FitCount(NextFreed(bp), asize);
                 }
             }
         }
@@ -765,37 +1531,41 @@ static inline void *FindFit(size_t asize){
             /* Same trick as above */
             if(NextFreed(tempAdd) == NULL){
                 ENSURES(Get(LabelPtr(tempAdd)) != SEGNODE);
-                return tempAdd;
+                return FitCount(tempAdd, asize);
             }
             else{
                 ENSURES(GetSize(HDRP(tempAdd)) ==
                         GetSize(HDRP(NextFreed(tempAdd))));
-                return NextFreed(tempAdd);
+                return FitCount(NextFreed(tempAdd), asize);
             }
         }
     }
     
-    return NULL;
+    return FitCount(NULL, asize);
 }
 
 
 
 /* place: Place block of asize bytes at start of free block bp */
 /* and split if remainder would be at least minimum block size */
-static inline void Place(void *bp, size_t asize){
+/* Return ZEROBIT if the block is zero past its links and footer */
+static inline int Place(void *bp, size_t asize){
     
     size_t csize = GetSize(HDRP(bp));
+    int zero = GetZero(bp);
     void *newPtr;
     
+    Touch(bp);
     if((csize - asize) >= (2 * DSIZE)){
         
+        CurArena->St.splits++;
         PutLabel(HDRP(bp), Pack(asize, 1));
         PutLabel(FTRP(bp), Pack(asize, 1)); /* Overwitten later */
         SetNextHDR(bp);
         
         newPtr = NextBlkp(bp);
-        PutLabel(HDRP(newPtr), Pack(csize-asize, 0)); 
-        PutLabel(FTRP(newPtr), Pack(csize-asize, 0));
+        PutLabel(HDRP(newPtr), Pack(csize-asize, zero)); 
+        PutLabel(FTRP(newPtr), Pack(csize-asize, zero));
         ENSURES(GetPrevAlloc(NextBlkp(newPtr)) == 0);
         InsertBlock(newPtr, GetSize(HDRP(newPtr)));
     }
@@ -805,168 +1575,2672 @@ static inline void Place(void *bp, size_t asize){
         SetNextHDR(bp);
     }
     
+    return zero;
 }
-/*
- *  Malloc Implementation
- *  ---------------------
- *  The following functions deal with the user-facing
- *  malloc implementation.
- */
 
-/*
- * Initialize: return -1 on error, 0 on success.
- */
-int mm_init(void) {
-    
-    size_t structSize = (MAXBINNUM + 1) * WSIZE;
-    heap_listp = (char *)mem_sbrk(4 * WSIZE + structSize);
-    dbg_printf("mm_init\n");
-    
-    /* Unsuccessful initialization */
-    if(heap_listp == (char *)(-1)){
-        return -1;
+
+/* AdjustSize: add the header and round a request up to a block */
+/* size, based on 8-bytes alignment */
+static inline size_t AdjustSize(size_t size){
+    if(size <= DSIZE + WSIZE){
+        return 2 * DSIZE;
     }
+    return DSIZE * ((size+WSIZE+(DSIZE-1))/DSIZE);
+}
+
+
+static void *QuickPop(size_t asize);
+static int QuickFlush(void);
+static int RemoteDrain(void);
+
+
+/* AllocZeroBlock: find or make a block of asize bytes in the */
+/* current arena and mark it allocated. Set zero to ZEROBIT if it */
+/* is zero past its links and footer. The arena lock must be held */
+static void *AllocZeroBlock(size_t asize, int *zero){
+    checkheap(1);  /* Let's make sure the heap is ok! */
     
-    /* Alignment padding */
-    Put(heap_listp, 0);                      
-    /* Prologue header, including the structure size */
-    Put(heap_listp + (1 * WSIZE), Pack(DSIZE + structSize, 1)); 
-    /* Prologue footer, including the structure size */
-    Put(heap_listp + (2 * WSIZE + structSize),
-        Pack(DSIZE + structSize, 1));
+    char *bp;
     
-    /* Epilogue header, the one previous to it is allocated */
-    /* Itself is also allocated */
-    Put(heap_listp + (3 * WSIZE) + structSize, Pack(0, 0x3));
+    CurArena->Since += asize;
+    
+    /* A deferred block of the same size is taken as it is */
+    if((bp = QuickPop(asize)) != NULL){
+        *zero = 0;
+        return bp;
+    }
+    
+    /* On a miss, the deferred blocks may coalesce into a fit */
+    bp = FindFit(asize);
+    if(bp == NULL && QuickFlush()){
+        bp = FindFit(asize);
+    }
+    if(bp != NULL){
+        DeleteBlock(bp);
+        *zero = Place(bp, asize);
+        return bp;
+    }
+    
+    /* We cannot find a block in list or BST */
+    if((bp = GrowHeap(asize)) == NULL){
+        return NULL;
+    }
+    else{
+        *zero = Place(bp, asize);
+    }
+    return bp;
+}
+
+
+/* AllocBlock: find or make a block of asize bytes in the current */
+/* arena and mark it allocated. The arena lock must be held */
+static inline void *AllocBlock(size_t asize){
+    int zero;
+    return AllocZeroBlock(asize, &zero);
+}
+
+
+/* AllocBatch: allocate n blocks of asize bytes side by side, out */
+/* of one free block found by one search or made by one extension */
+/* Return n, or 0 if out of memory. The arena lock must be held */
+static size_t AllocBatch(size_t asize, size_t n, void **ptrs){
+    
+    size_t need = asize * n;
+    size_t csize, i;
+    int zero;
+    char *bp;
+    
+    CurArena->Since += need;
+    bp = FindFit(need);
+    if(bp == NULL && QuickFlush()){
+        bp = FindFit(need);
+    }
+    if(bp != NULL){
+        DeleteBlock(bp);
+    }
+    else if((bp = GrowHeap(need)) == NULL){
+        return 0;
+    }
+    csize = GetSize(HDRP(bp));
+    zero = GetZero(bp);
+    
+    /* Carve all but the last one from the front */
+    for(i = 0; i < n - 1; i++){
+        PutLabel(HDRP(bp), Pack(asize, 1));
+        ptrs[i] = bp;
+        bp += asize;
+        Put(HDRP(bp), 0x2);   /* Previous is allocated */
+    }
+    
+    /* The last one is placed in the rest, which may split */
+    csize -= (n - 1) * asize;
+    PutLabel(HDRP(bp), Pack(csize, zero));
+    PutLabel(FTRP(bp), Pack(csize, zero));
+    Place(bp, asize);
+    ptrs[n - 1] = bp;
+    return n;
+}
+
+
+/* TrimBlock: give the end of a free block at the heap top back to */
+/* the system, keeping pad bytes of it. The block is not in any bin */
+/* Return the bytes released. The arena lock must be held */
+static size_t TrimBlock(void *bp, size_t pad){
+    
+    size_t size = GetSize(HDRP(bp));
+    uintptr_t page = mem_heap_pagesize();
+    int zero = GetZero(bp);
+    size_t keep, release;
+    
+    /* Space reserved by mm_reserve stays */
+    if(CurArena->Keep > (char *)bp && (size_t)(CurArena->Keep - (char *)bp) > pad){
+        pad = CurArena->Keep - (char *)bp;
+    }
+    if(pad >= size || (char *)NextBlkp(bp) != CurArena->Brk){
+        return 0;
+    }
+    
+    /* The new break falls on a page boundary, so that only whole */
+    /* pages, huge ones if they back the heap, are given back */
+    keep = (pad < 2 * DSIZE) ? 2 * DSIZE : pad;
+    keep = ((uintptr_t)bp + keep + page - 1) / page * page - (uintptr_t)bp;
+    if(keep >= size){
+        return 0;
+    }
+    release = size - keep;
+    
+    /* Only the chunk at the heap top can shrink */
+    pthread_mutex_lock(&SbrkLock);
+    if((char *)mem_heap_hi() + 1 != CurArena->Brk ||
+       (long)mem_sbrk(-(intptr_t)release) == -1){
+        pthread_mutex_unlock(&SbrkLock);
+        return 0;
+    }
+    CurArena->Brk -= release;
+    CurArena->Heap -= release;
+    Growth.trims++;
+    Growth.trimmed += release;
+    pthread_mutex_unlock(&SbrkLock);
+    
+    /* The heap is past its peak, so growth starts small again */
+    CurArena->Grow = CHUNKSIZE;
+    
+    dbg_printf("trim heap by %zu\n", release);
+    
+    PutLabel(HDRP(bp), Pack(keep, zero));
+    PutLabel(FTRP(bp), Pack(keep, zero));
+    Put(HDRP(NextBlkp(bp)), Pack(0, 1));   /* New epilogue header */
+    return release;
+}
+
+
+/* PurgeBlock: give the whole pages inside a free block back to */
+/* the system, all but its header, links and footer. The bytes */
+/* around them are cleared, so that the block is then zero, unless */
+/* huge pages make that too many to write */
+static inline void PurgeBlock(void *bp){
+    
+    uintptr_t page = mem_heap_pagesize();
+    char *lo = (char *)bp + 6 * WSIZE;
+    char *hi = FTRP(bp);
+    char *plo = (char *)(((uintptr_t)lo + page - 1) / page * page);
+    char *phi = (char *)((uintptr_t)hi / page * page);
+    
+    if(GetZero(bp) || plo >= phi){
+        return;
+    }
+    mem_purge(plo, phi - plo);
+    if((size_t)((plo - lo) + (hi - phi)) > 2 * mem_pagesize()){
+        return;
+    }
+    memset(lo, 0, plo - lo);
+    memset(phi, 0, hi - phi);
+    
+    PutLabel(HDRP(bp), Pack(GetSize(HDRP(bp)), ZEROBIT));
+    PutLabel(FTRP(bp), Pack(GetSize(HDRP(bp)), ZEROBIT));
+}
+
+
+/* FreeBlock: mark an allocated block free, coalesce it and */
+/* insert it into the free structures. The arena lock must be held */
+static void FreeBlock(void *bp){
+    
+    void *newPtr;
+    size_t size;
+    
+    size = GetSize(HDRP(bp));
+    dbg_printf("free block size = %zu\n", size);
+    dbg_printf("free address = 0x%lx\n", (unsigned long)bp);
+    PutLabel(HDRP(bp), Pack(size, 0));
+    PutLabel(FTRP(bp), Pack(size, 0));
+    ResetNextHDR(bp);   /* Set the header of next block */
+    
+    newPtr = coalesce(bp);
+    size = GetSize(HDRP(newPtr));
+    
+    /* Return large free space to the system */
+    if(size >= TrimThres && TrimBlock(newPtr, TopPad) > 0){
+        size = GetSize(HDRP(newPtr));
+    }
+    else if(PurgeThres > 0 && size >= PurgeThres){
+        PurgeBlock(newPtr);
+    }
+    InsertBlock(newPtr, size);
+}
+
+
+/* QuickInd: return the quick list of block size asize, QUICKNUM if */
+/* blocks of that size are not deferred */
+static inline size_t QuickInd(size_t asize){
+    if(asize <= CACHEMAX || asize > QUICKMAX) return QUICKNUM;
+    return (asize - CACHEMAX) / DSIZE - 1;
+}
+
+
+/* QuickPush: free an allocated block later. It goes on the quick */
+/* list of its size as it is, allocated bit and all, so that nothing */
+/* coalesces with it. Flush the lists once they hold QuickBytes */
+/* bytes. The arena lock must be held */
+static void QuickPush(void *bp){
+    
+    size_t size = GetSize(HDRP(bp));
+    size_t ind = QuickInd(size);
+    
+    if(ind == QUICKNUM || QuickBytes == 0){
+        FreeBlock(bp);
+        return;
+    }
+    Put(NextPtr(bp), CurArena->Quick[ind]);
+    CurArena->Quick[ind] = PtrToInt(bp);
+    CurArena->Deferred += size;
+    
+    if(CurArena->Deferred > QuickBytes){
+        QuickFlush();
+    }
+}
+
+
+/* QuickPop: take a deferred block of asize bytes, still allocated, */
+/* NULL if there is none. The arena lock must be held */
+static void *QuickPop(size_t asize){
+    
+    size_t ind = QuickInd(asize);
+    void *bp;
+    
+    if(ind == QUICKNUM || CurArena->Quick[ind] == 0){
+        return NULL;
+    }
+    bp = IntToPtr(CurArena->Quick[ind]);
+    CurArena->Quick[ind] = Get(NextPtr(bp));
+    CurArena->Deferred -= asize;
+    return bp;
+}
+
+
+/* QuickFlush: free every deferred block of the current arena, so */
+/* that they coalesce and get into the bins in one go, along with */
+/* those freed by other threads. Return 1 if there were any. The */
+/* arena lock must be held */
+static int QuickFlush(void){
+    
+    size_t ind;
+    void *bp;
+    int drained = RemoteDrain();
+    
+    if(CurArena->Deferred == 0){
+        return drained;
+    }
+    for(ind = 0; ind < QUICKNUM; ind++){
+        while(CurArena->Quick[ind] != 0){
+            bp = IntToPtr(CurArena->Quick[ind]);
+            CurArena->Quick[ind] = Get(NextPtr(bp));
+            FreeBlock(bp);
+        }
+    }
+    CurArena->Deferred = 0;
+    return 1;
+}
+
+
+
+/* AlignLead: return the slack in front of the first payload in */
+/* block bp aligned to align bytes, which can stand as a block */
+static inline size_t AlignLead(void *bp, size_t align){
+    
+    size_t lead = (align - (uintptr_t)bp % align) % align;
+    
+    if(lead != 0 && lead < 2 * DSIZE){
+        lead += align;
+    }
+    return lead;
+}
+
+
+/* AllocAligned: find or make a block of asize bytes whose payload */
+/* is aligned to align bytes. The leading slack is split off as a */
+/* free block. The arena lock must be held */
+static void *AllocAligned(size_t align, size_t asize){
+    
+    size_t need = asize + align + DSIZE;
+    size_t csize, lead;
+    int zero;
+    char *bp;
+    
+    /* The best fit of asize may well hold an aligned payload: */
+    /* a cache line often does, without asking for more */
+    bp = FindFit(asize);
+    if(bp != NULL && AlignLead(bp, align) + asize <= GetSize(HDRP(bp))){
+        DeleteBlock(bp);
+    }
+    else if((bp = FindFit(need)) != NULL ||
+            (QuickFlush() && (bp = FindFit(need)) != NULL)){
+        DeleteBlock(bp);
+    }
+    else if((bp = GrowHeap(need)) == NULL){
+        return NULL;
+    }
+    
+    /* The slack must be able to stand as a block of its own */
+    lead = AlignLead(bp, align);
+    
+    if(lead != 0){
+        csize = GetSize(HDRP(bp));
+        zero = GetZero(bp);
+        PutLabel(HDRP(bp), Pack(lead, zero));
+        PutLabel(FTRP(bp), Pack(lead, zero));
+        InsertBlock(bp, lead);
+        
+        bp += lead;
+        Put(HDRP(bp), Pack(csize - lead, zero));  /* Previous is free */
+        PutLabel(FTRP(bp), Pack(csize - lead, zero));
+    }
+    Place(bp, asize);
+    return bp;
+}
+
+
+
+/* ShrinkBlock: cut an allocated block down to asize bytes, and */
+/* free the tail if it can stand as a block. The arena lock must */
+/* be held */
+static void ShrinkBlock(void *bp, size_t asize){
+    
+    size_t csize = GetSize(HDRP(bp));
+    void *newPtr;
+    
+    if((csize - asize) < (2 * DSIZE)){
+        return;
+    }
+    
+    PutLabel(HDRP(bp), Pack(asize, 1));
+    newPtr = NextBlkp(bp);
+    Put(HDRP(newPtr), Pack(csize - asize, 0x3));  /* Freed right away */
+    FreeBlock(newPtr);
+}
+
+
+/* ReallocBlock: resize an allocated block to asize bytes in place: */
+/* shrink it, absorb a free successor, slide it down into a free */
+/* predecessor, or grow the heap when it is the last block. Return the */
+/* block pointer, or NULL if it has to move. The arena lock must */
+/* be held */
+static void *ReallocBlock(void *bp, size_t asize){
+    
+    size_t csize = GetSize(HDRP(bp));
+    size_t nsize, psize;
+    void *next = NextBlkp(bp);
+    void *prev, *newPtr;
+    
+    /* Shrink in place, returning the tail to the free structures */
+    if(asize <= csize){
+        ShrinkBlock(bp, asize);
+        return bp;
+    }
+    
+    nsize = GetAlloc(next) ? 0 : GetSize(HDRP(next));
+    
+    /* Absorb the free successor */
+    if(csize + nsize >= asize){
+        DeleteBlock(next);
+        Untouch(next);
+        PutLabel(HDRP(bp), Pack(csize + nsize, 1));
+        SetNextHDR(bp);
+        ShrinkBlock(bp, asize);
+        return bp;
+    }
+    
+    /* Absorb the free predecessor too, and move the data down */
+    if(!GetPrevAlloc(bp)){
+        prev = PrevBlkp(bp);
+        psize = GetSize(HDRP(prev));
+        if(psize + csize + nsize >= asize){
+            DeleteBlock(prev);
+            if(nsize != 0){
+                DeleteBlock(next);
+                Untouch(next);
+            }
+            Untouch(bp);
+            PutLabel(HDRP(prev), Pack(psize + csize + nsize, 1));
+            memmove(prev, bp, csize - WSIZE);
+            SetNextHDR(prev);
+            ShrinkBlock(prev, asize);
+            return prev;
+        }
+    }
+    
+    /* The block is the last one of the heap, and no free block */
+    /* could take it: extend the heap by the shortfall, or by the */
+    /* growth step, which coalesces with a free successor. The */
+    /* surplus goes back to the bins */
+    if((char *)(nsize ? NextBlkp(next) : next) == CurArena->Brk &&
+       FindFit(asize) == NULL){
+        newPtr = extend_heap(GrowStep(asize - csize - nsize, asize) / WSIZE);
+        if(newPtr == NULL){
+            return NULL;
+        }
+        
+        /* Another arena took the heap top, the space is elsewhere */
+        if(newPtr != next){
+            InsertBlock(newPtr, GetSize(HDRP(newPtr)));
+            return NULL;
+        }
+        Untouch(next);
+        PutLabel(HDRP(bp), Pack(csize + GetSize(HDRP(next)), 1));
+        SetNextHDR(bp);
+        ShrinkBlock(bp, asize);
+        return bp;
+    }
+    
+    return NULL;
+}
+
+
+#ifndef TLSF
+/* Purge the free blocks of at least min bytes in a tree, and the */
+/* lists following its nodes. Return the number of blocks purged */
+static size_t PurgeTreeRecur(void *bp, size_t min){
+    
+    size_t count = 0;
+    void *p;
+    
+    if(bp == NULL) return 0;
+    
+    /* Its left subtree only holds smaller blocks */
+    if(GetSize(HDRP(bp)) >= min){
+        for(p = bp; p != NULL; p = NextFreed(p)){
+            PurgeBlock(p);
+            count++;
+        }
+        count += PurgeTreeRecur(LeftFreed(bp), min);
+    }
+    return count + PurgeTreeRecur(RightFreed(bp), min);
+}
+#endif
+
+
+/* PurgeArena: purge every free block of the current arena that */
+/* holds a whole page. Return the number of blocks purged */
+static size_t PurgeArena(void){
+    
+    size_t min = mem_heap_pagesize() + 8 * WSIZE;
+    size_t count = 0;
+    size_t i;
+    void *bp;
+    
+    /* Range lists may hold such blocks too */
+    for(i = EXACTNUM; i <= SEGNUM; i++){
+        if(BinMax[i] < min) continue;
+        for(bp = IntToPtr(Get(GetBinAdd(i))); bp != NULL; bp = NextFreed(bp)){
+            if(GetSize(HDRP(bp)) >= min){
+                PurgeBlock(bp);
+                count++;
+            }
+        }
+    }
+    
+#ifdef TLSF
+    size_t fl, sl;
+    
+    for(fl = TlsfFl(min); fl < FLNUM; fl++){
+        for(sl = 0; sl < SLNUM; sl++){
+            for(bp = IntToPtr(Get(TlsfHead(fl, sl))); bp != NULL;
+                bp = NextFreed(bp)){
+                if(GetSize(HDRP(bp)) >= min){
+                    PurgeBlock(bp);
+                    count++;
+                }
+            }
+        }
+    }
+#else
+    for(i = SEGNUM + 1; i <= MAXBINNUM; i++){
+        if(BinMax[i] >= min){
+            count += PurgeTreeRecur(IntToPtr(Get(GetBinAdd(i))), min);
+        }
+    }
+#endif
+    return count;
+}
+
+
+
+/*
+ * -----------------------------------
+ *  Arena Functions start from here
+ *  ----------------------------------
+ */
+
+
+
+/* Take the lock of an arena and make it the current one */
+static inline void ArenaLock(Arena *a){
+    pthread_mutex_lock(&a->lock);
+    CurArena = a;
+}
+
+static inline void ArenaUnlock(Arena *a){
+    CurArena = NULL;
+    pthread_mutex_unlock(&a->lock);
+}
+
+
+/* Lay out the first chunk of the current arena: its prologue */
+/* holds the storage structure, followed by a free block of size */
+/* bytes. Return -1 on error, 0 on success */
+static int ArenaCreate(size_t size){
+    
+    size_t structSize = STRUCTSIZE;
+    char *p;
+    
+    pthread_mutex_lock(&SbrkLock);
+    p = NewChunk(PROLOGSIZE, size);
+    pthread_mutex_unlock(&SbrkLock);
+    
+    if(p == NULL){
+        return -1;
+    }
     
     /* Init all the pointers(offset) of structure to NULL */
-    memset(heap_listp + (3 * WSIZE), 0, structSize);
-    Root = heap_listp + 3 * WSIZE; /* Entrance of the structure */
+    memset(p + ROOTOFF, 0, structSize);
+    CurArena->Root = p + ROOTOFF; /* Entrance of the structure */
+    
+    if(size > 0){
+        InsertBlock(NextBlkp(p), size);
+    }
+    return 0;
+}
+
+
+/* Give a new thread an arena, round-robin. An arena is created */
+/* the first time a thread is assigned to it */
+static Arena *ArenaAssign(void){
+    
+    unsigned int ind = __atomic_fetch_add(&NextArena, 1, __ATOMIC_RELAXED);
+    Arena *a = &Arenas[ind % ArenaNum];
+    int err = 0;
+    
+    ArenaLock(a);
+    if(a->Root == NULL){
+        err = ArenaCreate(ARENACHUNK);
+    }
+    ArenaUnlock(a);
+    
+    /* Fall back to the first arena when the heap is exhausted */
+    return err ? &Arenas[0] : a;
+}
+
+
+/* Given an index in the chunk table, return the prologue */
+static inline char *ChunkAt(size_t ind){
+    return heap_listp + (size_t)ChunkTab[ind] * OFFSCALE;
+}
+
+
+/* Given a block pointer, return the arena owning its chunk */
+static inline Arena *ArenaOf(void *bp){
+    
+    unsigned int num = __atomic_load_n(&ChunkNum, __ATOMIC_ACQUIRE);
+    unsigned int offset = PtrToInt(bp);
+    unsigned int lo = 0, hi = num - 1, mid;
+    
+    /* Find the last chunk starting below bp */
+    while(lo < hi){
+        mid = (lo + hi + 1) / 2;
+        if(ChunkTab[mid] < offset) lo = mid;
+        else hi = mid - 1;
+    }
+    return &Arenas[Get(ChunkAt(lo))];
+}
+
+
+
+/*
+ * -----------------------------------------
+ *  Mapped Chunk Functions start from here
+ *  ----------------------------------------
+ */
+
+
+
+/* A request above the mmap threshold gets an anonymous mapping */
+/* of its own instead of a block. The mapping length and a tag */
+/* binding it to the payload address sit right before the payload */
+/* The mapping starts at the page holding that header */
+typedef struct {
+    size_t len;             /* Mapping length */
+    size_t tag;             /* Payload address ^ MMAPMAGIC */
+} MapHdr;
+
+
+/* Decide whether a pointer lies outside the heap, i.e. is mapped */
+static inline int IsMapped(void *bp){
+    return (char *)bp < heap_listp || (char *)bp > (char *)mem_heap_hi();
+}
+
+
+/* Given a mapped pointer, return its header */
+static inline MapHdr *MapOf(void *bp){
+    return (MapHdr *)((char *)bp - MMAPHDR);
+}
+
+/* Given a mapped pointer, return the start of its mapping */
+static inline char *MapBase(void *bp){
+    uintptr_t page = mem_pagesize();
+    return (char *)((uintptr_t)MapOf(bp) / page * page);
+}
+
+
+/* Decide whether a pointer outside the heap is a mapped chunk, */
+/* rather than foreign memory such as the dynamic loader hands */
+/* out before we are in place. The header may lie on the page */
+/* before the pointer, which foreign memory need not have mapped */
+static inline int IsOwnMap(void *bp){
+    uintptr_t page = mem_pagesize();
+    uintptr_t hdr = (uintptr_t)MapOf(bp);
+    unsigned char vec;
+    
+    if(hdr / page != (uintptr_t)bp / page &&
+       mincore((void *)(hdr / page * page), 1, &vec) != 0){
+        return 0;
+    }
+    return MapOf(bp)->tag == ((uintptr_t)bp ^ MMAPMAGIC);
+}
+
+
+/* Return how many of the len bytes from bp are mapped, as far as */
+/* we can tell about foreign memory */
+static size_t ForeignLen(void *bp, size_t len){
+    uintptr_t page = mem_pagesize();
+    uintptr_t p = ((uintptr_t)bp / page + 1) * page;
+    unsigned char vec;
+    
+    while(p - (uintptr_t)bp < len && mincore((void *)p, 1, &vec) == 0){
+        p += page;
+    }
+    return (p - (uintptr_t)bp < len) ? p - (uintptr_t)bp : len;
+}
+
+
+/* Give the request size, return the mapping length serving it, */
+/* or 0 if it cannot be represented */
+static inline size_t MapLen(size_t size){
+    size_t page = mem_pagesize();
+    
+    if(size > SIZE_MAX - MMAPHDR - page){
+        return 0;
+    }
+    return (size + MMAPHDR + page - 1) / page * page;
+}
+
+
+/* MapAlloc: serve a request with an anonymous mapping */
+static void *MapAlloc(size_t size){
+    
+    size_t len = MapLen(size);
+    char *p;
+    
+    if(len == 0){
+        return NULL;
+    }
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED){
+        return NULL;
+    }
+    
+    dbg_printf("mmap %zu bytes at 0x%lx\n", len, (unsigned long)p);
+    __atomic_fetch_add(&MapBytes, len, __ATOMIC_RELAXED);
+    p += MMAPHDR;
+    MapOf(p)->len = len;
+    MapOf(p)->tag = (uintptr_t)p ^ MMAPMAGIC;
+    return p;
+}
+
+
+/* MapFree: give a mapped chunk back to the system. Foreign */
+/* memory is not ours to release, and is left alone */
+static void MapFree(void *bp){
+    MapHdr *hdr = MapOf(bp);
+    
+    if(!IsOwnMap(bp)){
+        return;
+    }
+    __atomic_fetch_sub(&MapBytes, hdr->len, __ATOMIC_RELAXED);
+    munmap(MapBase(bp), hdr->len);
+}
+
+
+/* MapRealloc: resize a mapped chunk with mremap, which moves the */
+/* pages rather than copying them. Return NULL on failure, leaving */
+/* the chunk untouched */
+static void *MapRealloc(void *bp, size_t size){
+    
+    char *base = MapBase(bp);
+    size_t lead = (char *)bp - base;
+    size_t old = MapOf(bp)->len;
+    size_t len;
+    char *p;
+    
+    if(size > SIZE_MAX - lead || (len = MapLen(size + lead - MMAPHDR)) == 0){
+        return NULL;
+    }
+    p = mremap(base, old, len, MREMAP_MAYMOVE);
+    if(p == MAP_FAILED){
+        return NULL;
+    }
+    __atomic_fetch_add(&MapBytes, len - old, __ATOMIC_RELAXED);
+    
+    p += lead;
+    MapOf(p)->len = len;
+    MapOf(p)->tag = (uintptr_t)p ^ MMAPMAGIC;
+    return p;
+}
+
+
+/* Map a chunk whose payload is aligned to align bytes, a power of */
+/* two above DSIZE. The pages around the aligned part are unmapped */
+static void *MapAlign(size_t align, size_t size){
+    
+    uintptr_t page = mem_pagesize();
+    size_t len;
+    char *base, *start, *end, *p;
+    
+    if(size > SIZE_MAX - align || (len = MapLen(size + align)) == 0){
+        return NULL;
+    }
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED){
+        return NULL;
+    }
+    
+    p = (char *)(((uintptr_t)base + MMAPHDR + align - 1) & ~(align - 1));
+    start = (char *)((uintptr_t)(p - MMAPHDR) / page * page);
+    end = (char *)(((uintptr_t)(p + size) + page - 1) / page * page);
+    if(start > base) munmap(base, start - base);
+    if(base + len > end) munmap(end, base + len - end);
+    
+    MapOf(p)->len = end - start;
+    MapOf(p)->tag = (uintptr_t)p ^ MMAPMAGIC;
+    __atomic_fetch_add(&MapBytes, end - start, __ATOMIC_RELAXED);
+    return p;
+}
+
+
+
+/*
+ * -----------------------------------
+ *  Slab Functions start from here
+ *  ----------------------------------
+ */
+
+
+
+/* Give the request size of a small object, return its slot size */
+static inline size_t SlabSize(size_t size){
+    if(size <= 2 * DSIZE){
+        return 2 * DSIZE;
+    }
+    return DSIZE * ((size+(DSIZE-1))/DSIZE);
+}
+
+
+/* Give a pointer, return the index of its page in SlabMap */
+static inline size_t SlabPage(void *bp){
+    return (uintptr_t)bp / SLABPAGE - (uintptr_t)heap_listp / SLABPAGE;
+}
+
+
+/* Decide whether a pointer is a slot of a slab run */
+static inline int IsSlab(void *bp){
+    size_t page = SlabPage(bp);
+    return (__atomic_load_n(&SlabMap[page / 8], __ATOMIC_RELAXED)
+            >> (page % 8)) & 1;
+}
+
+
+/* Given a slot pointer, return the header of its run */
+static inline SlabRun *SlabOf(void *bp){
+    return (SlabRun *)((uintptr_t)bp & ~(uintptr_t)(SLABPAGE - 1));
+}
+
+
+/* The next two functions link a run into, and unlink it from, */
+/* the list of runs with free slots of the current arena */
+static inline void SlabLink(SlabRun *run, size_t ind){
+    unsigned int head = CurArena->Slab[ind];
+    
+    run->next = head;
+    run->prev = 0;
+    if(head != 0){
+        ((SlabRun *)IntToPtr(head))->prev = PtrToInt(run);
+    }
+    CurArena->Slab[ind] = PtrToInt(run);
+}
+
+static inline void SlabUnlink(SlabRun *run, size_t ind){
+    if(run->prev == 0){
+        CurArena->Slab[ind] = run->next;
+    }
+    else{
+        ((SlabRun *)IntToPtr(run->prev))->next = run->next;
+    }
+    if(run->next != 0){
+        ((SlabRun *)IntToPtr(run->next))->prev = run->prev;
+    }
+}
+
+
+/* DepotPush: share slot bp of class ind in arena a, without the */
+/* lock: push it on a Treiber stack whose head word holds the top */
+/* offset and a tag bumped by every change. The slot stays in use */
+/* in its run. Return 0, or -1 if the stack is full */
+static inline int DepotPush(Arena *a, void *bp, size_t ind){
+    
+    uint64_t head, top;
+    
+    if(__atomic_load_n(&a->DepotNum[ind], __ATOMIC_RELAXED) >= DEPOTMAX){
+        return -1;
+    }
+    __atomic_fetch_add(&a->DepotNum[ind], 1, __ATOMIC_RELAXED);
+    
+    head = __atomic_load_n(&a->Depot[ind], __ATOMIC_RELAXED);
+    do{
+        Put(NextPtr(bp), (unsigned int)head);
+        top = ((head >> 32) + 1) << 32 | PtrToInt(bp);
+    }while(!__atomic_compare_exchange_n(&a->Depot[ind], &head, top, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 0;
+}
+
+
+/* DepotPop: take a shared slot of class ind from arena a, without */
+/* the lock, NULL if there is none. The top may be taken and reused */
+/* meanwhile, so its link is read atomically and may be garbage, */
+/* but then the tag has changed and the swap fails. The heap past */
+/* the break stays mapped, so the read itself is always safe */
+static inline void *DepotPop(Arena *a, size_t ind){
+    
+    uint64_t head = __atomic_load_n(&a->Depot[ind], __ATOMIC_ACQUIRE);
+    uint64_t top;
+    void *bp;
+    
+    do{
+        if((unsigned int)head == 0){
+            return NULL;
+        }
+        bp = IntToPtr((unsigned int)head);
+        top = ((head >> 32) + 1) << 32 |
+              __atomic_load_n((unsigned int *)NextPtr(bp), __ATOMIC_RELAXED);
+    }while(!__atomic_compare_exchange_n(&a->Depot[ind], &head, top, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    
+    __atomic_fetch_sub(&a->DepotNum[ind], 1, __ATOMIC_RELAXED);
+    return bp;
+}
+
+
+/* Carve a new run of asize slots out of a page-aligned block */
+static SlabRun *SlabCreate(size_t asize){
+    
+    SlabRun *run;
+    size_t page;
+    
+    run = AllocAligned(SLABPAGE, AdjustSize(SLABPAGE));
+    if(run == NULL){
+        return NULL;
+    }
+    
+    run->free = 0;
+    run->size = asize;
+    run->used = 0;
+    run->bump = SLABHDR;
+    SlabLink(run, asize / DSIZE - 2);
+    
+    page = SlabPage(run);
+    __atomic_fetch_or(&SlabMap[page / 8], 1 << (page % 8), __ATOMIC_RELAXED);
+    return run;
+}
+
+
+/* SlabAlloc: take a slot of asize bytes from the first run with */
+/* room in the current arena. The arena lock must be held */
+static void *SlabAlloc(size_t asize){
+    
+    size_t ind = asize / DSIZE - 2;
+    SlabRun *run = IntToPtr(CurArena->Slab[ind]);
+    void *bp;
+    
+    /* Shared slots go before a new run */
+    if(run == NULL && (bp = DepotPop(CurArena, ind)) != NULL){
+        return bp;
+    }
+    if(run == NULL && (run = SlabCreate(asize)) == NULL){
+        return NULL;
+    }
+    
+    /* Reuse a freed slot, or bump into the untouched ones */
+    if(run->free != 0){
+        bp = IntToPtr(run->free);
+        run->free = Get(NextPtr(bp));
+    }
+    else{
+        bp = (char *)run + run->bump;
+        run->bump += asize;
+    }
+    run->used++;
+    
+    /* A full run leaves the list until a slot is freed */
+    if(run->free == 0 && run->bump + asize > SLABPAGE){
+        SlabUnlink(run, ind);
+    }
+    return bp;
+}
+
+
+/* SlabFree: put a slot back into its run. An empty run is given */
+/* back to the arena unless it is the last one of its class. The */
+/* arena lock must be held */
+static void SlabFree(void *bp){
+    
+    SlabRun *run = SlabOf(bp);
+    size_t ind = run->size / DSIZE - 2;
+    size_t page;
+    
+    /* A full run gets back on the list */
+    if(run->free == 0 && run->bump + run->size > SLABPAGE){
+        SlabLink(run, ind);
+    }
+    
+    Put(NextPtr(bp), run->free);
+    run->free = PtrToInt(bp);
+    run->used--;
+    
+    if(run->used == 0 && (run->prev != 0 || run->next != 0)){
+        SlabUnlink(run, ind);
+        page = SlabPage(run);
+        __atomic_fetch_and(&SlabMap[page / 8], ~(1 << (page % 8)),
+                           __ATOMIC_RELAXED);
+        FreeBlock(run);
+    }
+}
+
+
+/* Allocate asize bytes from the slabs or from the blocks of the */
+/* current arena. The arena lock must be held */
+static inline void *ArenaAlloc(size_t asize){
+    if(asize <= SLABMAX) return SlabAlloc(asize);
+    return AllocBlock(asize);
+}
+
+static inline void ArenaFree(void *bp){
+    if(IsSlab(bp)) SlabFree(bp);
+    else QuickPush(bp);
+}
+
+
+/* RemotePush: free a slot or block of arena a without its lock. It */
+/* is pushed onto the remote stack of a, linked through its Next ptr, */
+/* and stays allocated until a thread holding the lock drains it */
+static inline void RemotePush(Arena *a, void *bp){
+    
+    unsigned int head = __atomic_load_n(&a->Remote, __ATOMIC_RELAXED);
+    
+    do{
+        Put(NextPtr(bp), head);
+    }while(!__atomic_compare_exchange_n(&a->Remote, &head, PtrToInt(bp), 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/* RemoteDrain: free everything other threads pushed onto the */
+/* remote stack of the current arena. The whole stack is taken at */
+/* once, so pushers never wait. Return 1 if it freed any block. */
+/* The arena lock must be held */
+static int RemoteDrain(void){
+    
+    unsigned int off;
+    void *bp;
+    
+    if(__atomic_load_n(&CurArena->Remote, __ATOMIC_RELAXED) == 0){
+        return 0;
+    }
+    off = __atomic_exchange_n(&CurArena->Remote, 0, __ATOMIC_ACQUIRE);
+    if(off == 0){
+        return 0;
+    }
+    while(off != 0){
+        bp = IntToPtr(off);
+        off = Get(NextPtr(bp));
+        ArenaFree(bp);
+    }
+    return 1;
+}
+
+
+/* ArenaOwn: take the lock of the calling thread's arena to allocate */
+/* from it, first draining what other threads freed to it */
+static inline Arena *ArenaOwn(void){
+    
+    Arena *a = Cache.arena;
+    
+    ArenaLock(a);
+    RemoteDrain();
+    return a;
+}
+
+
+/* Give the request size, return the size of the slot or block */
+/* serving it */
+static inline size_t UnitSize(size_t size){
+    if(size <= SLABMAX) return SlabSize(size);
+    return AdjustSize(size);
+}
+
+
+/* Given an allocated pointer, return its slot or block size */
+static inline size_t GetUnitSize(void *bp){
+    if(IsSlab(bp)) return SlabOf(bp)->size;
+    return GetSize(HDRP(bp));
+}
+
+
+/* Given an allocated pointer, return the bytes usable by the caller */
+static inline size_t UsableSize(void *bp){
+    if(IsMapped(bp)){
+        if(!IsOwnMap(bp)) return 0;
+        return MapBase(bp) + MapOf(bp)->len - (char *)bp;
+    }
+    if(IsSlab(bp)) return SlabOf(bp)->size;
+    return GetSize(HDRP(bp)) - WSIZE;
+}
+
+
+
+/*
+ * -----------------------------------------
+ *  Thread Cache Functions start from here
+ *  ----------------------------------------
+ */
+
+
+
+/* Give the block size, return its thread cache class */
+static inline size_t GetCacheInd(size_t asize){
+    return asize / DSIZE - 2;
+}
+
+
+/* Flush a number of blocks from the top of one cache stack back */
+/* to the shared heap. Blocks of the same arena in a row are freed */
+/* under a single lock acquisition */
+static void CacheFlush(size_t ind, unsigned int num){
+    Arena *a = NULL, *owner;
+    void *bp;
+    
+    while(num-- > 0 && Cache.count[ind] > 0){
+        bp = IntToPtr(Cache.head[ind]);
+        Cache.head[ind] = Get(NextPtr(bp));
+        Cache.count[ind]--;
+        
+        /* Slots are shared with the other threads of their arena, */
+        /* and blocks of other arenas handed over, without the lock */
+        owner = ArenaOf(bp);
+        if(ind < SLABNUM && IsSlab(bp) && DepotPush(owner, bp, ind) == 0){
+            continue;
+        }
+        if(owner != Cache.arena){
+            RemotePush(owner, bp);
+            continue;
+        }
+        if(owner != a){
+            ArenaLock(a = owner);
+        }
+        ArenaFree(bp);
+    }
+    if(a != NULL) ArenaUnlock(a);
+}
+
+
+/* Thread exit destructor: return every cached block. The cache is */
+/* then dead: nothing would flush it again, so the frees that later */
+/* destructors make go straight back, and it is not refilled */
+static void CacheRelease(void *arg){
+    size_t i;
+    
+    arg = arg;
+    if(Cache.epoch != HeapEpoch) return;
+    for(i = 0; i < CACHENUM; i++){
+        CacheFlush(i, Cache.count[i]);
+    }
+    Cache.dead = 1;
+}
+
+
+static void CacheKeyInit(void){
+    pthread_key_create(&CacheKey, CacheRelease);
+}
+
+
+/* Make sure the calling thread's cache and arena belong to the */
+/* current heap. Stale blocks of an old heap are simply forgotten */
+static inline void CacheAttach(void){
+    if(Cache.epoch == HeapEpoch) return;
+    
+    memset(&Cache, 0, sizeof(Cache));
+    Cache.epoch = HeapEpoch;
+    Cache.arena = ArenaAssign();
+    pthread_once(&CacheKeyOnce, CacheKeyInit);
+    pthread_setspecific(CacheKey, &Cache);
+}
+
+
+/* Pop a cached block of asize bytes, NULL if the stack is empty */
+static inline void *CachePop(size_t asize){
+    size_t ind = GetCacheInd(asize);
+    void *bp;
+    
+    CacheAttach();
+    if(Cache.count[ind] == 0) return NULL;
+    
+    bp = IntToPtr(Cache.head[ind]);
+    Cache.head[ind] = Get(NextPtr(bp));
+    Cache.count[ind]--;
+    return bp;
+}
+
+
+/* Push an allocated block onto the cache of its size. A full */
+/* stack first returns a batch of blocks to the heap, a dead one */
+/* returns the block right away */
+static inline void CachePush(void *bp, size_t asize){
+    size_t ind = GetCacheInd(asize);
+    
+    CacheAttach();
+    if(Cache.count[ind] == CACHEDEPTH){
+        CacheFlush(ind, CACHEBATCH);
+    }
+    
+    Put(NextPtr(bp), Cache.head[ind]);
+    Cache.head[ind] = PtrToInt(bp);
+    Cache.count[ind]++;
+    if(Cache.dead){
+        CacheFlush(ind, 1);
+    }
+}
+
+
+/* Refill the cache of asize bytes with a batch of blocks, unless */
+/* it is dead. The arena lock must be held */
+static void CacheFill(size_t asize){
+    size_t ind = GetCacheInd(asize);
+    void *bp;
+    
+    while(!Cache.dead && Cache.count[ind] < CACHEBATCH){
+        if((bp = ArenaAlloc(asize)) == NULL) return;
+        Put(NextPtr(bp), Cache.head[ind]);
+        Cache.head[ind] = PtrToInt(bp);
+        Cache.count[ind]++;
+    }
+}
+
+
+/* Refill the cache of asize bytes with a batch of the slots shared */
+/* in the thread's arena, without its lock, or just one into a */
+/* dead cache. Return one of them, NULL if there are none */
+static void *CacheTake(size_t asize){
+    size_t ind = GetCacheInd(asize);
+    unsigned int batch = Cache.dead ? 1 : CACHEBATCH;
+    void *bp;
+    
+    while(Cache.count[ind] < batch &&
+          (bp = DepotPop(Cache.arena, ind)) != NULL){
+        Put(NextPtr(bp), Cache.head[ind]);
+        Cache.head[ind] = PtrToInt(bp);
+        Cache.count[ind]++;
+    }
+    return CachePop(asize);
+}
+
+
+
+/*
+ * -----------------------------------------
+ *  Heap Profiler Functions start from here
+ *  -----------------------------------------
+ */
+
+/* A call stack that sampled objects were allocated from, with */
+/* the sampled objects and bytes still live and ever allocated */
+typedef struct {
+    uint64_t hash;
+    size_t depth;
+    void *pc[PROFDEPTH];
+    size_t live, liveBytes;
+    size_t count, bytes;
+} ProfStack;
+
+/* A live sampled object, keyed by its address, 0 if none */
+typedef struct {
+    uintptr_t ptr;
+    size_t size;
+    unsigned int stack;
+} ProfObj;
+
+/* Mean bytes between samples, 0 when the profiler is off */
+static size_t ProfRate;
+
+/* Tables mapped the first time the profiler is on, guarded by */
+/* the profiler lock. The filter counts the live samples per hash */
+/* of their address, so that free looks an address up only if */
+/* one may be sampled */
+static pthread_mutex_t ProfLock = PTHREAD_MUTEX_INITIALIZER;
+static ProfStack *ProfStacks;
+static ProfObj *ProfObjs;
+static unsigned short *ProfFilter;
+static size_t ProfStackNum;
+static size_t ProfLive;
+
+/* Where a signal dumps the profile, and whether a dump is due */
+static char ProfPrefix[256];
+static unsigned int ProfSeq;
+static int ProfPending;
+
+/* Bytes the thread allocates before its next sample, its random */
+/* state and whether it is taking a sample */
+static __thread long ProfLeft;
+static __thread uint64_t ProfSeed;
+static __thread int ProfBusy;
+
+
+/* Approximate log2 of a positive double, to a hundredth: the */
+/* exponent plus a parabola through the mantissa */
+static inline double ProfLog2(double x){
+    union { double d; uint64_t u; } v = { x };
+    int e = (int)((v.u >> 52) & 0x7ff) - 1023;
+    
+    v.u = (v.u & ((1ULL << 52) - 1)) | (1023ULL << 52);
+    return e + (-v.d / 3 + 2) * v.d - 5.0 / 3;
+}
+
+/* Draw the bytes to the next sample: exponentially distributed, */
+/* so that samples are a Poisson process over the allocated bytes */
+static inline long ProfNext(void){
+    uint64_t x = ProfSeed;
+    double u;
+    
+    if(x == 0){
+        x = (uintptr_t)&ProfSeed ^ (uint64_t)time(NULL) << 32 ^ 0x9e3779b97f4a7c15ULL;
+    }
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    ProfSeed = x;
+    
+    /* u is uniform in (0, 1], and -ln(u) exponential */
+    u = ((x >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return (long)(-ProfLog2(u) * 0.6931471805599453 * ProfRate) + 1;
+}
+
+/* Hash the address of an object, for the filter and the table */
+static inline size_t ProfHash(uintptr_t p){
+    return (size_t)(((p >> 4) * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+/* Map the tables, return -1 if out of memory. The profiler lock */
+/* must be held */
+static int ProfMap(void){
+    char *p;
+    
+    if(ProfStacks != NULL){
+        return 0;
+    }
+    p = mmap(NULL, PROFSTACKS * sizeof(ProfStack) + PROFOBJS * sizeof(ProfObj) +
+             PROFFILTER * sizeof(unsigned short), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(p == MAP_FAILED){
+        return -1;
+    }
+    ProfObjs = (ProfObj *)(p + PROFSTACKS * sizeof(ProfStack));
+    ProfFilter = (unsigned short *)(ProfObjs + PROFOBJS);
+    ProfStacks = (ProfStack *)p;
+    return 0;
+}
+
+/* Forget every sample, as the heap they were taken in is gone. */
+/* The profiler lock must be held */
+static void ProfReset(void){
+    if(ProfStacks == NULL){
+        return;
+    }
+    memset(ProfStacks, 0, ProfStackNum * sizeof(ProfStack));
+    memset(ProfObjs, 0, PROFOBJS * sizeof(ProfObj));
+    memset(ProfFilter, 0, PROFFILTER * sizeof(unsigned short));
+    ProfStackNum = 0;
+    __atomic_store_n(&ProfLive, 0, __ATOMIC_RELAXED);
+}
+
+/* Find or add the stack of depth frames at pc, return its index, */
+/* or -1 if the table is full. The profiler lock must be held */
+static long ProfStackOf(void **pc, size_t depth){
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+    ProfStack *s;
+    
+    for(i = 0; i < depth; i++){
+        hash = (hash ^ (uintptr_t)pc[i]) * 0x100000001b3ULL;
+    }
+    for(i = hash % PROFSTACKS; i < hash % PROFSTACKS + PROFSTACKS; i++){
+        s = &ProfStacks[i % PROFSTACKS];
+        if(s->depth == 0){
+            if(ProfStackNum >= PROFSTACKS * 3 / 4) return -1;
+            ProfStackNum++;
+            s->hash = hash;
+            s->depth = depth;
+            memcpy(s->pc, pc, depth * sizeof(void *));
+            return i % PROFSTACKS;
+        }
+        if(s->hash == hash && s->depth == depth &&
+           memcmp(s->pc, pc, depth * sizeof(void *)) == 0){
+            return i % PROFSTACKS;
+        }
+    }
+    return -1;
+}
+
+/* Return the slot of the sampled object at bp, or of the empty */
+/* slot that ends its probe. The profiler lock must be held */
+static inline size_t ProfSlot(const void *bp){
+    size_t i = ProfHash((uintptr_t)bp) % PROFOBJS;
+    
+    while(ProfObjs[i].ptr != 0 && ProfObjs[i].ptr != (uintptr_t)bp){
+        i = (i + 1) % PROFOBJS;
+    }
+    return i;
+}
+
+/* Remove the sampled object of slot i, shifting back the objects */
+/* probed past it. The profiler lock must be held */
+static void ProfRemove(size_t i){
+    ProfObj *o = &ProfObjs[i];
+    ProfStack *s = &ProfStacks[o->stack];
+    size_t j, home;
+    
+    s->live--;
+    s->liveBytes -= o->size;
+    __atomic_fetch_sub(&ProfFilter[ProfHash(o->ptr) % PROFFILTER], 1,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&ProfLive, 1, __ATOMIC_RELAXED);
+    
+    for(j = (i + 1) % PROFOBJS; ProfObjs[j].ptr != 0; j = (j + 1) % PROFOBJS){
+        home = ProfHash(ProfObjs[j].ptr) % PROFOBJS;
+        if((j - home + PROFOBJS) % PROFOBJS >= (j - i + PROFOBJS) % PROFOBJS){
+            ProfObjs[i] = ProfObjs[j];
+            i = j;
+        }
+    }
+    ProfObjs[i].ptr = 0;
+}
+
+
+/* Small writer of decimal and hex numbers for the dumps, which */
+/* may run in a signal handler and must not allocate */
+typedef struct {
+    int fd;
+    int err;
+    size_t len;
+    char buf[PROFBUF];
+} ProfOut;
+
+static void ProfFlush(ProfOut *o){
+    size_t off = 0;
+    ssize_t n;
+    
+    while(off < o->len && !o->err){
+        if((n = write(o->fd, o->buf + off, o->len - off)) < 0){
+            if(errno != EINTR) o->err = 1;
+            continue;
+        }
+        off += n;
+    }
+    o->len = 0;
+}
+
+static void ProfPuts(ProfOut *o, const char *s){
+    for(; *s != '\0'; s++){
+        if(o->len == PROFBUF) ProfFlush(o);
+        o->buf[o->len++] = *s;
+    }
+}
+
+static void ProfPutNum(ProfOut *o, uint64_t v, unsigned int base){
+    char num[24];
+    char *p = num + sizeof(num) - 1;
+    
+    *p = '\0';
+    do{
+        *--p = "0123456789abcdef"[v % base];
+        v /= base;
+    }while(v != 0);
+    if(base == 16) *--p = 'x', *--p = '0';
+    ProfPuts(o, p);
+}
+
+/* Write a count line of the profile: "live: bytes [count: bytes]" */
+static void ProfPutCounts(ProfOut *o, size_t live, size_t liveBytes,
+                          size_t count, size_t bytes){
+    ProfPutNum(o, live, 10);
+    ProfPuts(o, ": ");
+    ProfPutNum(o, liveBytes, 10);
+    ProfPuts(o, " [");
+    ProfPutNum(o, count, 10);
+    ProfPuts(o, ": ");
+    ProfPutNum(o, bytes, 10);
+    ProfPuts(o, "] @");
+}
+
+/* Write the profile to fd in the legacy heap profile format of */
+/* gperftools, which pprof reads: the live and allocated counts of */
+/* the samples of each stack, then the mappings of the process so */
+/* that the addresses can be symbolized. The profiler lock must be */
+/* held. Return -1 if the write fails */
+static int ProfWrite(int fd){
+    ProfOut o;
+    size_t live = 0, liveBytes = 0, count = 0, bytes = 0;
+    size_t i, j;
+    ProfStack *s;
+    ssize_t n;
+    int maps;
+    
+    o.fd = fd;
+    o.err = 0;
+    o.len = 0;
+    for(i = 0; ProfStacks != NULL && i < PROFSTACKS; i++){
+        live += ProfStacks[i].live;
+        liveBytes += ProfStacks[i].liveBytes;
+        count += ProfStacks[i].count;
+        bytes += ProfStacks[i].bytes;
+    }
+    ProfPuts(&o, "heap profile: ");
+    ProfPutCounts(&o, live, liveBytes, count, bytes);
+    ProfPuts(&o, " heap_v2/");
+    ProfPutNum(&o, ProfRate, 10);
+    ProfPuts(&o, "\n");
+    
+    for(i = 0; ProfStacks != NULL && i < PROFSTACKS; i++){
+        s = &ProfStacks[i];
+        if(s->count == 0) continue;
+        ProfPutCounts(&o, s->live, s->liveBytes, s->count, s->bytes);
+        for(j = 0; j < s->depth; j++){
+            ProfPuts(&o, " ");
+            ProfPutNum(&o, (uintptr_t)s->pc[j], 16);
+        }
+        ProfPuts(&o, "\n");
+    }
+    
+    ProfPuts(&o, "\nMAPPED_LIBRARIES:\n");
+    ProfFlush(&o);
+    if((maps = open("/proc/self/maps", O_RDONLY)) >= 0){
+        while((n = read(maps, o.buf, PROFBUF)) > 0 ||
+              (n < 0 && errno == EINTR)){
+            o.len = (n > 0) ? n : 0;
+            ProfFlush(&o);
+        }
+        close(maps);
+    }
+    return o.err ? -1 : 0;
+}
+
+/* Dump the profile to the next file named after the signal prefix, */
+/* the process and a sequence number. The profiler lock must be held */
+static void ProfDumpFile(void){
+    ProfOut name;
+    int fd;
+    
+    name.fd = -1;
+    name.err = 1;
+    name.len = 0;
+    ProfPuts(&name, ProfPrefix);
+    ProfPuts(&name, ".");
+    ProfPutNum(&name, getpid(), 10);
+    ProfPuts(&name, ".");
+    ProfPutNum(&name, ProfSeq++, 10);
+    ProfPuts(&name, ".heap");
+    name.buf[name.len < PROFBUF ? name.len : PROFBUF - 1] = '\0';
+    
+    __atomic_store_n(&ProfPending, 0, __ATOMIC_RELAXED);
+    if((fd = open(name.buf, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0){
+        ProfWrite(fd);
+        close(fd);
+    }
+}
+
+/* Note a signal for a dump. No lock can be taken in a handler, so */
+/* the dump is left to the next allocation, see ProfAlloc */
+static void ProfSignal(int sig){
+    (void)sig;
+    __atomic_store_n(&ProfPending, 1, __ATOMIC_RELAXED);
+}
+
+/* Dump the profile if a signal asked for it. Called with no lock */
+/* held, outside of ProfSample */
+static __attribute__((noinline)) void ProfDumpPending(void){
+    pthread_mutex_lock(&ProfLock);
+    if(__atomic_load_n(&ProfPending, __ATOMIC_RELAXED)){
+        ProfDumpFile();
+    }
+    pthread_mutex_unlock(&ProfLock);
+}
+
+
+/* Install the dump on signal sig, to files named after prefix. */
+/* Return -1 on error */
+static int ProfSignalSet(int sig, const char *prefix){
+    struct sigaction sa;
+    
+    pthread_mutex_lock(&ProfLock);
+    strncpy(ProfPrefix, prefix, sizeof(ProfPrefix) - 1);
+    pthread_mutex_unlock(&ProfLock);
+    
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ProfSignal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(sig, &sa, NULL);
+}
+
+
+/* ProfSample: take the call stack of bp, a new object of size */
+/* bytes, if the thread has allocated enough since its last */
+/* sample. Called with no lock held */
+static __attribute__((noinline)) void ProfSample(void *bp, size_t size){
+    void *pc[PROFDEPTH + 2];
+    size_t depth;
+    long stack;
+    size_t i;
+    
+    /* Objects backtrace allocates are not sampled, nor those */
+    /* before the first draw of the thread runs out */
+    if(ProfBusy){
+        return;
+    }
+    if(ProfSeed == 0 && (ProfLeft = ProfNext() - (long)size) >= 0){
+        return;
+    }
+    ProfLeft = ProfNext();
+    
+    /* The first two frames are this function and the malloc call */
+    ProfBusy = 1;
+    depth = backtrace(pc, PROFDEPTH + 2);
+    ProfBusy = 0;
+    depth = (depth > 2) ? depth - 2 : 0;
+    
+    pthread_mutex_lock(&ProfLock);
+    if(ProfMap() == 0 && (stack = ProfStackOf(pc + 2, depth)) >= 0){
+        ProfStacks[stack].count++;
+        ProfStacks[stack].bytes += size;
+        
+        /* The object is followed while live, room allowing */
+        i = ProfSlot(bp);
+        if(ProfObjs[i].ptr == 0 && ProfLive < PROFOBJS * 3 / 4){
+            ProfObjs[i].ptr = (uintptr_t)bp;
+            ProfObjs[i].size = size;
+            ProfObjs[i].stack = stack;
+            ProfStacks[stack].live++;
+            ProfStacks[stack].liveBytes += size;
+            __atomic_fetch_add(&ProfFilter[ProfHash((uintptr_t)bp) % PROFFILTER],
+                               1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&ProfLive, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if(__atomic_load_n(&ProfPending, __ATOMIC_RELAXED)){
+        ProfDumpFile();
+    }
+    pthread_mutex_unlock(&ProfLock);
+}
+
+/* Count size bytes allocated at bp, and sample it when the bytes */
+/* to the next sample run out. A dump a signal asked for is made */
+/* here too. Return bp */
+static inline void *ProfAlloc(void *bp, size_t size){
+    if(__builtin_expect(ProfRate != 0, 0) && bp != NULL){
+        if((ProfLeft -= (long)size) < 0){
+            ProfSample(bp, size);
+        }
+        else if(__atomic_load_n(&ProfPending, __ATOMIC_RELAXED) && !ProfBusy){
+            ProfDumpPending();
+        }
+    }
+    return bp;
+}
+
+/* Forget the object at bp, about to be freed, if it was sampled */
+static inline void ProfFree(void *bp){
+    size_t i;
+    
+    if(__builtin_expect(__atomic_load_n(&ProfLive, __ATOMIC_RELAXED) == 0, 1) ||
+       __atomic_load_n(&ProfFilter[ProfHash((uintptr_t)bp) % PROFFILTER],
+                       __ATOMIC_RELAXED) == 0){
+        return;
+    }
+    pthread_mutex_lock(&ProfLock);
+    i = ProfSlot(bp);
+    if(ProfObjs[i].ptr != 0){
+        ProfRemove(i);
+    }
+    pthread_mutex_unlock(&ProfLock);
+}
+
+/* A resized object is sampled as a new one */
+static inline void *ProfRealloc(void *oldptr, void *newptr, size_t size){
+    if(newptr != NULL){
+        ProfFree(oldptr);
+        ProfAlloc(newptr, size);
+    }
+    return newptr;
+}
+
+/* Turn the profiler on with a mean of rate bytes between samples, */
+/* or off if rate is 0. Return -1 if out of memory */
+static int ProfStart(size_t rate){
+    void *pc[1];
+    int err = 0;
+    
+    /* backtrace loads its unwinder on first use, which allocates */
+    if(rate != 0){
+        ProfBusy = 1;
+        backtrace(pc, 1);
+        ProfBusy = 0;
+    }
+    pthread_mutex_lock(&ProfLock);
+    if(rate != 0) err = ProfMap();
+    if(!err) ProfRate = rate;
+    pthread_mutex_unlock(&ProfLock);
+    return err;
+}
+
+#ifndef DRIVER
+/* Dump the final profile of a preloaded process */
+static void ProfExit(void){
+    pthread_mutex_lock(&ProfLock);
+    ProfDumpFile();
+    pthread_mutex_unlock(&ProfLock);
+}
+
+/* ProfEnv: in a preloaded build, MMPROF=rate turns the profiler */
+/* on, dumping to MMPROF_PREFIX.pid.n.heap (mmprof by default) on */
+/* SIGUSR2 and at exit */
+static void ProfEnv(void){
+    const char *rate = getenv("MMPROF");
+    const char *prefix = getenv("MMPROF_PREFIX");
+    
+    if(rate == NULL || strtoul(rate, NULL, 0) == 0 ||
+       ProfStart(strtoul(rate, NULL, 0)) != 0){
+        return;
+    }
+    ProfSignalSet(SIGUSR2, prefix ? prefix : "mmprof");
+    atexit(ProfExit);
+}
+#endif
+
+
+/*
+ *  Malloc Implementation
+ *  ---------------------
+ *  The following functions deal with the user-facing
+ *  malloc implementation.
+ */
+
+/* Set once the heap is in place, by mm_init or by the first call */
+/* into the allocator, so that a preloaded build needs no setup */
+static int HeapReady;
+static pthread_mutex_t InitLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int InInit;
+
+/* Around fork, every lock of the allocator is held, so that the */
+/* child never inherits a lock taken by a thread that is gone */
+static void ForkPrepare(void){
+    size_t i;
+    pthread_mutex_lock(&ProfLock);
+    for(i = 0; i < MAXARENA; i++) pthread_mutex_lock(&Arenas[i].lock);
+    pthread_mutex_lock(&SbrkLock);
+}
+
+static void ForkRelease(void){
+    size_t i;
+    pthread_mutex_unlock(&SbrkLock);
+    for(i = MAXARENA; i > 0; i--) pthread_mutex_unlock(&Arenas[i - 1].lock);
+    pthread_mutex_unlock(&ProfLock);
+}
+
+/* HeapSetup: set up memlib and the heap on first use. A call made */
+/* by libc from within, e.g. by sysconf, fails rather than wait on */
+/* itself. Return -1 on error, 0 on success */
+static int HeapSetup(void){
+    
+    static int forkReady;
+    int err = 0, first = 0;
+    
+    if(InInit){
+        return -1;
+    }
+    InInit = 1;
+    pthread_mutex_lock(&InitLock);
+    if(!HeapReady){
+        if(mem_heap_lo() == NULL){
+            mem_init();
+        }
+        err = (mem_heap_lo() == MAP_FAILED) ? -1 : mm_init();
+        if(!err && !forkReady){
+            forkReady = first = 1;
+            pthread_atfork(ForkPrepare, ForkRelease, ForkRelease);
+        }
+    }
+    pthread_mutex_unlock(&InitLock);
+    InInit = 0;
+    
+#ifndef DRIVER
+    /* The profiler may allocate, once the heap is in place */
+    if(first){
+        ProfEnv();
+    }
+#endif
+    return err;
+}
+
+/* Make sure the heap is in place, return -1 if it cannot be */
+static inline int HeapInit(void){
+    if(__builtin_expect(__atomic_load_n(&HeapReady, __ATOMIC_ACQUIRE), 1)){
+        return 0;
+    }
+    return HeapSetup();
+}
+
+
+/*
+ * Initialize: return -1 on error, 0 on success.
+ */
+int mm_init(void) {
+    
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i;
+    int err;
+    
+    dbg_printf("mm_init\n");
+    
+    /* One arena per processor */
+    ArenaNum = (cpus < 1) ? 1 : (cpus > MAXARENA) ? MAXARENA : cpus;
+    NextArena = 0;
+    ChunkNum = 0;
+    for(i = 0; i < MAXARENA; i++){
+        pthread_mutex_init(&Arenas[i].lock, NULL);
+        Arenas[i].Root = NULL;
+        Arenas[i].Base = NULL;
+        Arenas[i].Grow = CHUNKSIZE;
+        Arenas[i].Since = 0;
+        Arenas[i].Brk = NULL;
+        Arenas[i].Keep = NULL;
+        Arenas[i].Heap = 0;
+        memset(&Arenas[i].St, 0, sizeof(Arenas[i].St));
+        memset(Arenas[i].Slab, 0, sizeof(Arenas[i].Slab));
+        memset(Arenas[i].Quick, 0, sizeof(Arenas[i].Quick));
+        Arenas[i].Deferred = 0;
+        Arenas[i].Remote = 0;
+        memset(Arenas[i].Depot, 0, sizeof(Arenas[i].Depot));
+        memset(Arenas[i].DepotNum, 0, sizeof(Arenas[i].DepotNum));
+#ifndef NDEBUG
+        Arenas[i].TouchNum = 0;
+        Arenas[i].Checks = 0;
+#endif
+    }
+    memset(SlabMap, 0, sizeof(SlabMap));
+    
+    /* heap_listp is always at the beginning of first prologue */
+    heap_listp = (char *)mem_heap_lo() + mem_heapsize() + DSIZE;
+    
+    /* The first arena starts the heap with an empty structure */
+    ArenaLock(&Arenas[0]);
+    err = ArenaCreate(0);
+    ArenaUnlock(&Arenas[0]);
+    
+    /* Unsuccessful initialization */
+    if(err){
+        return -1;
+    }
+    
+    /* Blocks cached by any thread belong to the old heap, and so */
+    /* do the objects sampled by the profiler */
+    HeapEpoch++;
+    memset(&Growth, 0, sizeof(Growth));
+    pthread_mutex_lock(&ProfLock);
+    ProfReset();
+    pthread_mutex_unlock(&ProfLock);
+    
+    __atomic_store_n(&HeapReady, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* ObjAlloc: allocate an object of size bytes, at least one, once */
+/* the heap is in place. calloc calls it rather than malloc, which */
+/* the compiler would fold with the clearing into a calloc call */
+static void *ObjAlloc(size_t size){
+    
+    size_t asize;  /* Adjusted size */
+    size_t i;
+    Arena *a;
+    char *bp;
+    
+    /* Huge requests, and those a block header cannot describe, */
+    /* get a mapping of their own */
+    if(size >= MmapThres || size > MAXCHUNK - DSIZE){
+        return MapAlloc(size);
+    }
+    
+    /* Objects up to SLABMAX bytes live in slabs, without header */
+    asize = UnitSize(size);
+    dbg_printf("malloc %zu, asize = %zu\n", size, asize);
+    
+    /* Small sizes are served by the thread cache first, then */
+    /* slots by those shared in the arena */
+    if(asize <= CACHEMAX && (bp = CachePop(asize)) != NULL){
+        return bp;
+    }
+    if(asize <= SLABMAX && (bp = CacheTake(asize)) != NULL){
+        return bp;
+    }
+    
+    CacheAttach();
+    a = ArenaOwn();
+    bp = ArenaAlloc(asize);
+    if(bp != NULL && asize <= CACHEMAX){
+        CacheFill(asize);
+    }
+    ArenaUnlock(a);
+    
+    /* The heap is exhausted, but other arenas may have room */
+    for(i = 0; bp == NULL && i < ArenaNum; i++){
+        a = &Arenas[i];
+        if(a == Cache.arena) continue;
+        ArenaLock(a);
+        if(a->Root != NULL) bp = ArenaAlloc(asize);
+        ArenaUnlock(a);
+    }
+    
+    return bp;
+}
+
+/*
+ * malloc: same behavior as lib malloc
+ */
+void *malloc (size_t size) {
+    
+    if(HeapInit()){
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    /* Like glibc, give a unique pointer for 0 bytes */
+    return ProfAlloc(ObjAlloc((size == 0) ? 1 : size), size);
+}
+
+/*
+ * free: same behavior as lib free
+ */
+void free(void *bp){
+    
+    size_t size;
+    Arena *a;
+    
+    /* free a NULL pointer, or one from before the heap existed */ 
+    if(bp == NULL || HeapInit()) return;
+    ProfFree(bp);
+    
+    if(IsMapped(bp)){
+        MapFree(bp);
+        return;
+    }
+    
+    size = GetUnitSize(bp);
+    if(size <= CACHEMAX){
+        CachePush(bp, size);
+        return;
+    }
+    
+    /* Route the block back to the arena that owns it. Another */
+    /* thread's arena gets it on its remote stack, without the lock */
+    CacheAttach();
+    a = ArenaOf(bp);
+    if(a != Cache.arena){
+        RemotePush(a, bp);
+        return;
+    }
+    ArenaLock(a);
+    QuickPush(bp);
+    ArenaUnlock(a);
+}
+
+
+/*
+ * realloc: same behavior as lib realloc
+ */
+void *realloc(void *oldptr, size_t size)
+{
+    
+    size_t oldsize;
+    size_t asize;
+    void *newptr;
+    Arena *a;
+
+    /* If oldptr is NULL, then this is just malloc, for any size. */
+    if(oldptr == NULL) {
+	return malloc(size);
+    }
+
+    /* If size == 0 then this is just free, and we return NULL. */
+    if(size == 0) {
+	free(oldptr);
+	return NULL;
+    }
+
+    if(HeapInit()) {
+	return malloc(size);
+    }
+    
+    /* Foreign memory is copied as far as it may reach, its size */
+    /* is unknown */
+    if(IsMapped(oldptr) && !IsOwnMap(oldptr)){
+        if((newptr = malloc(size)) != NULL){
+            memcpy(newptr, oldptr, ForeignLen(oldptr, size));
+        }
+        return newptr;
+    }
+    
+    /* A mapped chunk is resized by remapping its pages, as long */
+    /* as it stays above the threshold */
+    if(IsMapped(oldptr)){
+        if(size >= MmapThres || size > MAXCHUNK - DSIZE){
+            return ProfRealloc(oldptr, MapRealloc(oldptr, size), size);
+        }
+    }
+    
+    /* A slot still large enough is kept */
+    else if(IsSlab(oldptr)){
+        if(size <= SlabOf(oldptr)->size){
+            return ProfRealloc(oldptr, oldptr, size);
+        }
+    }
+    
+    /* Resize a block in place if its neighbors allow. It never */
+    /* shrinks to a slab size, which the thread caches hold slots of */
+    else if(size < MmapThres && size <= MAXCHUNK - DSIZE){
+        asize = AdjustSize((size > SLABMAX) ? size : SLABMAX + 1);
+        ArenaLock(a = ArenaOf(oldptr));
+        newptr = ReallocBlock(oldptr, asize);
+        ArenaUnlock(a);
+        if(newptr != NULL){
+            return ProfRealloc(oldptr, newptr, size);
+        }
+    }
+
+    newptr = malloc(size);
+
+    /* If realloc() fails the original block is left untouched  */
+    if(newptr == NULL) {
+	return NULL;
+    }
+    
+    /* Copy the old data */
+    oldsize = UsableSize(oldptr);
+    if(size < oldsize) oldsize = size;
+    memcpy(newptr, oldptr, oldsize);
+    
+    /* Free the old block */
+    free(oldptr);
+    
+    return newptr;
+}
+
+
+/* ZeroAlloc: allocate a zero object of bytes bytes, once the */
+/* heap is in place */
+static void *ZeroAlloc(size_t bytes){
+    
+    size_t asize;
+    char *newptr, *ftr;
+    int zero = 0;
+    Arena *a;
+    
+    if(bytes == 0){
+        return ObjAlloc(1);
+    }
+    
+    /* A fresh mapping is zero already */
+    if(bytes >= MmapThres || bytes > MAXCHUNK - DSIZE){
+        return MapAlloc(bytes);
+    }
+    
+    /* Slots and cached blocks are small and have been used */
+    asize = UnitSize(bytes);
+    if(asize <= CACHEMAX){
+        newptr = ObjAlloc(bytes);
+        if(newptr != NULL) memset(newptr, 0, bytes);
+        return newptr;
+    }
+    
+    CacheAttach();
+    a = ArenaOwn();
+    newptr = AllocZeroBlock(asize, &zero);
+    ArenaUnlock(a);
+    
+    /* The heap is exhausted, but other arenas may have room */
+    if(newptr == NULL && (newptr = ObjAlloc(bytes)) == NULL){
+        return NULL;
+    }
+    
+    /* Only the links and the footer of a zero block are to clear */
+    if(zero){
+        memset(newptr, 0, (bytes < 6 * WSIZE) ? bytes : 6 * WSIZE);
+        ftr = FTRP(newptr);
+        if(newptr + bytes > ftr) memset(ftr, 0, newptr + bytes - ftr);
+    }
+    else{
+        memset(newptr, 0, bytes);
+    }
+    return newptr;
+}
+
+/*
+ * calloc: same behavior as lib calloc
+ */
+void *calloc (size_t nmemb, size_t size){
+    
+    size_t bytes;
+    
+    if(size != 0 && nmemb > SIZE_MAX / size){
+        errno = ENOMEM;
+        return NULL;
+    }
+    bytes = nmemb * size;
+    if(HeapInit()){
+        errno = ENOMEM;
+        return NULL;
+    }
+    return ProfAlloc(ZeroAlloc(bytes), bytes);
+}
+
+
+
+/*
+ * memalign: allocate size bytes aligned to align bytes, a power of
+ * two. The slack in front of the aligned payload goes back to the bins
+ */
+void *memalign(size_t align, size_t size){
+    
+    size_t asize, i;
+    Arena *a;
+    char *bp;
+    
+    if(align == 0 || (align & (align - 1)) != 0){
+        errno = EINVAL;
+        return NULL;
+    }
+    if(align <= DSIZE){
+        return malloc(size);
+    }
+    if(HeapInit()){
+        errno = ENOMEM;
+        return NULL;
+    }
+    if(size == 0){
+        size = 1;
+    }
+    
+    /* Huge requests or alignments get a mapping of their own */
+    if(size >= MmapThres || align >= MmapThres ||
+       size > MAXCHUNK - DSIZE - align){
+        return ProfAlloc(MapAlign(align, size), size);
+    }
+    
+    /* Slots are not aligned, so even small objects get blocks */
+    asize = AdjustSize((size > SLABMAX) ? size : SLABMAX + 1);
+    
+    CacheAttach();
+    a = ArenaOwn();
+    bp = AllocAligned(align, asize);
+    ArenaUnlock(a);
+    
+    /* The heap is exhausted, but other arenas may have room */
+    for(i = 0; bp == NULL && i < ArenaNum; i++){
+        a = &Arenas[i];
+        if(a == Cache.arena) continue;
+        ArenaLock(a);
+        if(a->Root != NULL) bp = AllocAligned(align, asize);
+        ArenaUnlock(a);
+    }
+    
+    return ProfAlloc(bp, size);
+}
+
+/*
+ * posix_memalign: same behavior as lib posix_memalign
+ */
+int posix_memalign(void **memptr, size_t align, size_t size){
+    
+    void *newptr;
+    
+    if(align == 0 || (align & (align - 1)) != 0 ||
+       align % sizeof(void *) != 0){
+        return EINVAL;
+    }
+    newptr = memalign(align, size);
+    if(newptr == NULL){
+        return ENOMEM;
+    }
+    *memptr = newptr;
+    return 0;
+}
+
+/*
+ * aligned_alloc: same behavior as lib aligned_alloc
+ */
+void *aligned_alloc(size_t align, size_t size){
+    return memalign(align, size);
+}
+
+/*
+ * valloc: allocate size bytes aligned to a page
+ */
+void *valloc(size_t size){
+    return memalign(mem_pagesize(), size);
+}
+
+/*
+ * pvalloc: allocate size bytes rounded up to whole pages, aligned
+ * to a page
+ */
+void *pvalloc(size_t size){
+    size_t page = mem_pagesize();
+    
+    if(size > SIZE_MAX - page){
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, (size + page - 1) / page * page);
+}
+
+/*
+ * reallocarray: same behavior as lib reallocarray
+ */
+void *reallocarray(void *oldptr, size_t nmemb, size_t size){
+    if(size != 0 && nmemb > SIZE_MAX / size){
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(oldptr, nmemb * size);
+}
+
+/*
+ * malloc_usable_size: return the bytes usable in an allocated object,
+ * 0 for NULL or foreign memory
+ */
+size_t malloc_usable_size(void *bp){
+    if(bp == NULL || HeapInit()) return 0;
+    return UsableSize(bp);
+}
+
+
+#ifndef DRIVER
+
+/*
+ * The rest of the glibc interface, for a preloaded build. Parameters
+ * and counters map onto mm_mallopt, mm_trim and mm_stats
+ */
+
+int mallopt(int param, int value){
+    
+    if(value < 0){
+        return 0;
+    }
+    switch(param){
+    case M_TRIM_THRESHOLD:
+        return mm_mallopt(MM_TRIM_THRESHOLD, value);
+    case M_TOP_PAD:
+        return mm_mallopt(MM_TOP_PAD, value);
+    case M_MMAP_THRESHOLD:
+        return mm_mallopt(MM_MMAP_THRESHOLD, value);
+    default:
+        return 0;
+    }
+}
+
+int malloc_trim(size_t pad){
+    return mm_trim(pad);
+}
+
+#if __GLIBC_PREREQ(2, 33)
+struct mallinfo2 mallinfo2(void){
+    
+    struct mallinfo2 mi;
+    mm_stats_t st;
+    size_t i;
+    
+    mm_stats(&st);
+    memset(&mi, 0, sizeof(mi));
+    mi.arena = st.heap;
+    mi.hblkhd = st.mapped;
+    mi.uordblks = st.live - st.mapped;
+    for(i = 0; i < MM_STATS_BINS; i++){
+        mi.ordblks += st.bin_count[i];
+        mi.fordblks += st.bin_bytes[i];
+    }
+    return mi;
+}
+#endif
+
+void malloc_stats(void){
+    
+    mm_stats_t st;
+    
+    mm_stats(&st);
+    fprintf(stderr, "heap bytes     = %10zu\n", st.heap);
+    fprintf(stderr, "mapped bytes   = %10zu\n", st.mapped);
+    fprintf(stderr, "in use bytes   = %10zu\n", st.live);
+}
+
+#endif
+
+
+
+/*
+ * mm_malloc_batch: allocate n objects of size bytes into ptrs, carving
+ * them out of as few free blocks as possible. Return the number of
+ * objects allocated, less than n only if memory runs out
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs){
+    
+    size_t asize, num, i;
+    size_t done = 0;
+    Arena *a;
+    void *bp;
+    
+    if(size == 0 || HeapInit()){
+        return 0;
+    }
+    if(size >= MmapThres || size > MAXCHUNK - DSIZE){
+        for(; done < n && (ptrs[done] = ProfAlloc(MapAlloc(size), size)) != NULL;
+            done++);
+        return done;
+    }
     
-    /* heap_listp is always at the beginning of prologue */
-    heap_listp += 2 * WSIZE;
+    asize = UnitSize(size);
+    CacheAttach();
+    a = ArenaOwn();
+    while(done < n){
+        if(asize <= SLABMAX){
+            if((bp = SlabAlloc(asize)) == NULL) break;
+            ptrs[done++] = bp;
+            continue;
+        }
+        num = (asize > BATCHMAX / 2) ? 1 : BATCHMAX / asize;
+        num = (num < n - done) ? num : n - done;
+        if(AllocBatch(asize, num, ptrs + done) == 0) break;
+        done += num;
+    }
+    ArenaUnlock(a);
+    for(i = 0; i < done; i++){
+        ProfAlloc(ptrs[i], size);
+    }
     
-    return 0;
+    /* The heap is exhausted, but other arenas may have room */
+    for(; done < n && (ptrs[done] = malloc(size)) != NULL; done++);
+    return done;
+}
+
+
+/* Order two pointers by address, for qsort */
+static int CompareAddr(const void *x, const void *y){
+    uintptr_t p = (uintptr_t)*(void * const *)x;
+    uintptr_t q = (uintptr_t)*(void * const *)y;
+    return (p > q) - (p < q);
 }
 
 /*
- * malloc: same behavior as lib malloc
+ * mm_free_batch: free the n objects in ptrs. The array is sorted by
+ * address in place, and runs of neighbouring blocks are freed as one,
+ * so they coalesce and enter the bins once
  */
-void *malloc (size_t size) {
-    checkheap(1);  /* Let's make sure the heap is ok! */
+void mm_free_batch(void **ptrs, size_t n){
     
-    size_t asize;  /* Adjusted size */
-    size_t extendsize; 
+    size_t i, j, size;
+    Arena *a = NULL, *owner;
     char *bp;
     
-    if(size == 0){
-        return NULL;
-    }
+    qsort(ptrs, n, sizeof(void *), CompareAddr);
     
-    /* Adjust the size to asize based on 8-bytes alignment */
-    if(size <= DSIZE + WSIZE){
-        asize = 2 * DSIZE;
-    }
-    else{
-        asize = DSIZE * ((size+WSIZE+(DSIZE-1))/DSIZE);
+    for(i = 0; i < n; i = j){
+        bp = ptrs[i];
+        j = i + 1;
+        if(bp == NULL) continue;
+        ProfFree(bp);
+        
+        if(IsMapped(bp)){
+            MapFree(bp);
+            continue;
+        }
+        
+        /* Keep the lock while the blocks stay in one arena */
+        owner = ArenaOf(bp);
+        if(owner != a){
+            if(a != NULL) ArenaUnlock(a);
+            ArenaLock(a = owner);
+        }
+        if(IsSlab(bp)){
+            SlabFree(bp);
+            continue;
+        }
+        
+        /* Fuse the following neighbours into one allocated block */
+        size = GetSize(HDRP(bp));
+        for(; j < n && (char *)ptrs[j] == bp + size; j++){
+            size += GetSize(HDRP(ptrs[j]));
+            Untouch(ptrs[j]);
+        }
+        if(j > i + 1){
+            PutLabel(HDRP(bp), Pack(size, 1));
+        }
+        FreeBlock(bp);
     }
     
-    dbg_printf("malloc %zu, asize = %zu\n", size, asize);
+    if(a != NULL) ArenaUnlock(a);
+}
+
+
+/*
+ * mm_mallopt: set a tunable parameter, return 1 on success and 0
+ * if the parameter is unknown
+ */
+int mm_mallopt(int param, size_t value){
     
-    bp = FindFit(asize);
-    if(bp != NULL){
-        DeleteBlock(bp);
-        Place(bp, asize);
-        return bp;
+    switch(param){
+    case MM_MMAP_THRESHOLD:
+        MmapThres = value;
+        return 1;
+    case MM_TRIM_THRESHOLD:
+        TrimThres = value;
+        return 1;
+    case MM_TOP_PAD:
+        TopPad = value;
+        return 1;
+    case MM_PURGE_THRESHOLD:
+        PurgeThres = value;
+        return 1;
+    case MM_GROW_MAX:
+        GrowMax = (value < CHUNKSIZE) ? CHUNKSIZE : value & ~(size_t)(DSIZE - 1);
+        return 1;
+    case MM_CHECK_RATE:
+        CheckRate = value;
+        return 1;
+    case MM_PROFILE_RATE:
+        return ProfStart(value) == 0;
+    case MM_QUICK_BYTES:
+        QuickBytes = value;
+        return 1;
+    default:
+        return 0;
     }
+}
+
+
+/*
+ * mm_trim: give free memory back to the system: shrink the heap to
+ * keep pad free bytes at its top, and purge the pages inside every
+ * large free block. Return 1 if any memory was released, 0 if not
+ */
+int mm_trim(size_t pad){
     
-    /* We cannot find a block in list or BST */
-    extendsize = Max(asize, CHUNKSIZE);
-    if((bp = extend_heap(extendsize/WSIZE)) == NULL){
-        return NULL;
-    }
-    else{
-        Place(bp, asize);
+    int released = 0;
+    Arena *a;
+    void *bp;
+    size_t i, j;
+    
+    for(i = 0; i < MAXARENA; i++){
+        a = &Arenas[i];
+        ArenaLock(a);
+        if(a->Root != NULL){
+            
+            /* Shared slots go back to their runs, which may empty */
+            for(j = 0; j < SLABNUM; j++){
+                while((bp = DepotPop(a, j)) != NULL){
+                    SlabFree(bp);
+                }
+            }
+            QuickFlush();   /* Drains the remote stack too */
+            
+            /* The last block of the arena, if it ends the heap */
+            if(!GetPrevAlloc(a->Brk)){
+                bp = PrevBlkp(a->Brk);
+                DeleteBlock(bp);
+                released |= TrimBlock(bp, pad) > 0;
+                InsertBlock(bp, GetSize(HDRP(bp)));
+            }
+            released |= PurgeArena() > 0;
+        }
+        ArenaUnlock(a);
     }
-    return bp;
+    return released;
 }
 
+
 /*
- * free: same behavior as lib free
+ * mm_reserve: grow the heap ahead of time, so that the calling
+ * thread's arena ends with a free block of at least bytes bytes,
+ * which trimming leaves alone. With MM_RESERVE_PREFAULT its pages
+ * are faulted in too. Return 0 on success, -1 if out of memory
  */
-void free(void *bp){
+int mm_reserve(size_t bytes, int flags){
     
-    void *newPtr;
-    size_t size;
+    size_t need, tail = 0;
+    Arena *a;
+    char *bp;
     
-    /* free a NULL pointer */ 
-    if(bp == NULL) return;
+    if(bytes > MAXCHUNK - DSIZE || HeapInit()){
+        errno = ENOMEM;
+        return -1;
+    }
+    need = (bytes < 2 * DSIZE) ? 2 * DSIZE : DSIZE * ((bytes + DSIZE - 1) / DSIZE);
     
-    size = GetSize(HDRP(bp));
-    dbg_printf("free block size = %zu\n", size);
-    dbg_printf("free address = 0x%lx\n", (unsigned long)bp);
-    PutLabel(HDRP(bp), Pack(size, 0));
-    PutLabel(FTRP(bp), Pack(size, 0));
-    ResetNextHDR(bp);   /* Set the header of next block */
+    CacheAttach();
+    ArenaLock(a = Cache.arena);
+    if(!GetPrevAlloc(a->Brk)){
+        tail = GetSize(HDRP(PrevBlkp(a->Brk)));
+    }
     
-    newPtr = coalesce(bp);
-    InsertBlock(newPtr, GetSize(HDRP(newPtr)));
+    /* Extend the free block ending the arena, or start a new chunk */
+    /* if another arena took the heap top */
+    if(tail >= need){
+        bp = PrevBlkp(a->Brk);
+        DeleteBlock(bp);
+    }
+    else if((bp = extend_heap((need - tail)/WSIZE)) != NULL &&
+            GetSize(HDRP(bp)) < need){
+        InsertBlock(bp, GetSize(HDRP(bp)));
+        bp = extend_heap(need/WSIZE);
+    }
+    if(bp == NULL){
+        ArenaUnlock(a);
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    if(flags & MM_RESERVE_PREFAULT){
+        mem_prefault(bp, GetSize(HDRP(bp)) - WSIZE);
+    }
+    a->Keep = a->Brk;
+    a->Since = 0;
+    InsertBlock(bp, GetSize(HDRP(bp)));
+    ArenaUnlock(a);
+    return 0;
 }
 
 
 /*
- * realloc: same behavior as lib realloc
+ * mm_stats: copy the allocator counters into st. Arenas keep their
+ * own counters, which are summed here without taking their locks,
+ * so they may be off by the operations in flight
  */
-void *realloc(void *oldptr, size_t size)
-{
+void mm_stats(mm_stats_t *st){
     
-    size_t oldsize;
-    void *newptr;
-
-    /* If size == 0 then this is just free, and we return NULL. */
-    if(size == 0) {
-	free(oldptr);
-	return NULL;
+    size_t heap = 0, free = 0;
+    mm_stats_t *a;
+    size_t i, j;
+    
+    pthread_mutex_lock(&SbrkLock);
+    *st = Growth;
+    st->heap = mem_heapsize();
+    pthread_mutex_unlock(&SbrkLock);
+    
+    for(i = 0; i < MAXARENA; i++){
+        a = &Arenas[i].St;
+        heap += __atomic_load_n(&Arenas[i].Heap, __ATOMIC_RELAXED);
+        for(j = 0; j < MM_STATS_BINS; j++){
+            st->bin_count[j] += __atomic_load_n(&a->bin_count[j], __ATOMIC_RELAXED);
+            st->bin_bytes[j] += __atomic_load_n(&a->bin_bytes[j], __ATOMIC_RELAXED);
+            free += __atomic_load_n(&a->bin_bytes[j], __ATOMIC_RELAXED);
+        }
+        for(j = 0; j < 4; j++){
+            st->coalesce[j] += __atomic_load_n(&a->coalesce[j], __ATOMIC_RELAXED);
+        }
+        st->fit_exact += __atomic_load_n(&a->fit_exact, __ATOMIC_RELAXED);
+        st->fit_closest += __atomic_load_n(&a->fit_closest, __ATOMIC_RELAXED);
+        st->fit_miss += __atomic_load_n(&a->fit_miss, __ATOMIC_RELAXED);
+        st->splits += __atomic_load_n(&a->splits, __ATOMIC_RELAXED);
+        st->tree_depth = Max(st->tree_depth,
+                             __atomic_load_n(&a->tree_depth, __ATOMIC_RELAXED));
     }
+    
+    /* Cached blocks and slab runs count as live */
+    st->mapped = __atomic_load_n(&MapBytes, __ATOMIC_RELAXED);
+    st->live = (heap > free ? heap - free : 0) + st->mapped;
+}
 
-    /* If oldptr is NULL, then this is just malloc. */
-    if(oldptr == NULL) {
-	return malloc(size);
-    }
 
-    newptr = malloc(size);
 
-    /* If realloc() fails the original block is left untouched  */
-    if(newptr == NULL) {
-	return NULL;
-    }
-    
-    /* Copy the old data */
-    oldsize = GetSize(HDRP(oldptr));
-    if(size < oldsize) oldsize = size;
-    memcpy(newptr, oldptr, oldsize);
+/*
+ * mm_profile_dump: write the heap profile to fd, in the format of
+ * gperftools that pprof reads. Return 0 on success, -1 on error
+ */
+int mm_profile_dump(int fd){
     
-    /* Free the old block */
-    free(oldptr);
+    int err;
     
-    return newptr;
+    pthread_mutex_lock(&ProfLock);
+    err = ProfWrite(fd);
+    pthread_mutex_unlock(&ProfLock);
+    return err;
+}
+
+/*
+ * mm_profile_signal: dump the heap profile to prefix.pid.n.heap, n
+ * counting up from 0, at the first allocation after the process gets
+ * signal sig. Return 0 on success, -1 on error
+ */
+int mm_profile_signal(int sig, const char *prefix){
+    return ProfSignalSet(sig, prefix);
 }
 
 
 /*
- * calloc: same behavior as lib calloc
+ * mm_heap_walk: call fn on every block of the heap, chunk by chunk in
+ * address order, holding the lock of the arena owning the chunk. Stop
+ * when fn returns non-zero, and return that, else 0. Mapped chunks are
+ * not part of the heap, and are not walked
  */
-void *calloc (size_t nmemb, size_t size){
+int mm_heap_walk(mm_walk_fn fn, void *arg){
     
-    size_t bytes = nmemb * size;
-    void *newptr;
+    size_t i, num = __atomic_load_n(&ChunkNum, __ATOMIC_ACQUIRE);
+    mm_block_t blk;
+    char *prologue;
+    void *bp;
+    Arena *a;
+    int stop = 0;
+    
+    for(i = 0; i < num && !stop; i++){
+        prologue = ChunkAt(i);
+        blk.arena = Get(prologue);
+        ArenaLock(a = &Arenas[blk.arena]);
+        for(bp = NextBlkp(prologue); GetSize(HDRP(bp)) != 0 && !stop;
+            bp = NextBlkp(bp)){
+            blk.ptr = bp;
+            blk.size = GetSize(HDRP(bp));
+            blk.flags = GetAlloc(bp) | (GetPrevAlloc(bp) ? MM_BLOCK_PREV_ALLOC : 0);
+            if(GetAlloc(bp)){
+                blk.bin = MM_BLOCK_NOBIN;
+                if(IsSlab(bp)) blk.flags |= MM_BLOCK_SLAB;
+            }
+            else{
+                blk.bin = GetBinInd(blk.size);
+                if(GetZero(bp)) blk.flags |= MM_BLOCK_ZERO;
+            }
+            stop = fn(&blk, arg);
+        }
+        ArenaUnlock(a);
+    }
+    return stop;
+}
 
-    newptr = malloc(bytes);
-    memset(newptr, 0, bytes);
 
-    return newptr;
+/* Records of a snapshot waiting to be written */
+typedef struct {
+    int fd;
+    int err;
+    size_t num;
+    snap_rec_t rec[SNAPBUF];
+} SnapOut;
+
+/* Write out the records of a snapshot, return -1 on error */
+static int SnapFlush(SnapOut *o){
+    char *p = (char *)o->rec;
+    size_t len = o->num * sizeof(snap_rec_t);
+    ssize_t n;
+    
+    while(len > 0 && !o->err){
+        if((n = write(o->fd, p, len)) < 0){
+            if(errno != EINTR) o->err = 1;
+            continue;
+        }
+        p += n;
+        len -= n;
+    }
+    o->num = 0;
+    return o->err ? -1 : 0;
+}
+
+/* mm_heap_walk callback of mm_heap_snapshot: add the record of blk */
+static int SnapBlock(const mm_block_t *blk, void *arg){
+    SnapOut *o = arg;
+    snap_rec_t *r = &o->rec[o->num++];
+    
+    r->offset = ((char *)blk->ptr - (char *)mem_heap_lo()) / SNAP_UNIT;
+    r->size = blk->size;
+    r->flags = blk->flags;
+    r->bin = blk->bin;
+    r->arena = blk->arena;
+    r->pad = 0;
+    return (o->num == SNAPBUF) ? SnapFlush(o) : 0;
 }
 
+/*
+ * mm_heap_snapshot: write a record of every block of the heap to fd,
+ * in the format of util/snapshot.h. Return 0 on success, -1 on error
+ */
+int mm_heap_snapshot(int fd){
+    
+    static SnapOut out;
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    snap_hdr_t hdr;
+    int err;
+    
+    hdr.magic = SNAP_MAGIC;
+    hdr.version = SNAP_VERSION;
+    hdr.base = (uintptr_t)mem_heap_lo();
+    hdr.heap = mem_heapsize();
+    
+    /* The records are buffered out of the stack, one snapshot at */
+    /* a time */
+    pthread_mutex_lock(&lock);
+    out.fd = fd;
+    out.err = 0;
+    out.num = 0;
+    if(write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)){
+        out.err = 1;
+    }
+    err = out.err ? -1 : mm_heap_walk(SnapBlock, &out);
+    if(!err){
+        err = SnapFlush(&out);
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
 
 
 /*
@@ -1004,6 +4278,9 @@ void checkBlock(void *bp){
         ENSURES(GetSize(HDRP(bp)) == GetSize(FTRP(bp)));
     }
     
+    /* Only free blocks are known zero */
+    ENSURES(!GetAlloc(bp) || !GetZero(bp));
+    
     /* Block header's next-alloc bit's consistency */
     ENSURES(GetAlloc(NextBlkp(bp)) == GetNextAlloc(bp));
     
@@ -1034,18 +4311,12 @@ int checkList(size_t binNum){
     
     void *BinAdd = GetBinAdd(binNum);
     void *bp = IntToPtr(Get(BinAdd));
-    size_t blockSize;
     int count = 0;
     
-    /* Get block size in this bin */
-    if(bp != NULL){
-        blockSize = GetSize(HDRP(bp));
-    }
-    
     for(; bp != NULL; bp = NextFreed(bp)){
         
         /* Size consistency */
-        ENSURES(GetSize(HDRP(bp)) == blockSize);
+        ENSURES(GetBinInd(GetSize(HDRP(bp))) == binNum);
         
         /* Check for in heap */
         ENSURES(in_heap(bp));
@@ -1096,11 +4367,15 @@ int checkTreeRecur(void *bp){
             ENSURES(PrevFreed(RightFreed(head)) == head);
             /* Check for size consistency */
             ENSURES(GetSize(HDRP(head)) < GetSize(HDRP(RightFreed(head))));
+            /* Check for priority order */
+            ENSURES(Get(PrioPtr(head)) >= Get(PrioPtr(RightFreed(head))));
         }
         if(LeftFreed(head) != NULL){
             ENSURES(PrevFreed(LeftFreed(head)) == head);
             /* Check for size consistency */
             ENSURES(GetSize(HDRP(head)) > GetSize(HDRP(LeftFreed(head))));
+            /* Check for priority order */
+            ENSURES(Get(PrioPtr(head)) >= Get(PrioPtr(LeftFreed(head))));
         }
         if(PrevFreed(head) != NULL){
             if(Get(LabelPtr(head)) == LEFT){
@@ -1132,60 +4407,301 @@ int checkTree(size_t binNum){
     
 }
 
+/* Check the TLSF index: list linking, class membership and */
+/* bitmaps. Return the num of free blocks in it */
+int checkTlsf(void){
+    
+    dbg_printf("Checking TLSF index\n");
+    
+    void *bp;
+    size_t fl, sl;
+    int count = 0;
+    
+    for(fl = 0; fl < FLNUM; fl++){
+        for(sl = 0; sl < SLNUM; sl++){
+            bp = IntToPtr(Get(TlsfHead(fl, sl)));
+            
+            /* Bitmap consistency */
+            ENSURES(((Get(TlsfSlMap(fl)) >> sl) & 1) == (bp != NULL));
+            if(bp != NULL){
+                ENSURES((Get(TlsfFlMap()) >> fl) & 1);
+            }
+            
+            for(; bp != NULL; bp = NextFreed(bp)){
+                
+                /* Class consistency */
+                ENSURES(GetSize(HDRP(bp)) > BLKTHRES);
+                ENSURES(TlsfFl(GetSize(HDRP(bp))) == fl);
+                ENSURES(TlsfSl(GetSize(HDRP(bp)), fl) == sl);
+                
+                /* Check for in heap */
+                ENSURES(in_heap(bp));
+                
+                /* Pointer consistency */
+                ENSURES(NextFreed(PrevFreed(bp)) == bp);
+                if(NextFreed(bp) != NULL){
+                    ENSURES(PrevFreed(NextFreed(bp)) == bp);
+                }
+                count++;
+            }
+        }
+    }
+    
+    return count;
+}
+
+
+/* Check the runs with free slots of one slab class */
+void checkSlab(size_t ind){
+    
+    dbg_printf("Checking slab class No. %zu\n", ind);
+    
+    SlabRun *run = IntToPtr(CurArena->Slab[ind]);
+    
+    for(; run != NULL; run = IntToPtr(run->next)){
+        
+        /* Marked as a run, page aligned, right class */
+        ENSURES(IsSlab(run));
+        ENSURES((uintptr_t)run % SLABPAGE == 0);
+        ENSURES(run->size == (ind + 2) * DSIZE);
+        
+        /* It has room */
+        ENSURES(run->free != 0 || run->bump + run->size <= SLABPAGE);
+        ENSURES(run->used * run->size <= run->bump - SLABHDR);
+        
+        /* Pointer consistency */
+        if(run->next != 0){
+            ENSURES(((SlabRun *)IntToPtr(run->next))->prev ==
+                    PtrToInt(run));
+        }
+    }
+}
+
+
+/* Check one arena, whose lock must be held */
 /* Returns 0 if no errors were found, otherwise returns the error */
-int mm_checkheap(int verbose) {
+static int checkArena(Arena *a){
     
     void *bp;
+    char *prologue;
     size_t i;
+    size_t num = __atomic_load_n(&ChunkNum, __ATOMIC_ACQUIRE);
     size_t totalFreeNum = 0;
     size_t listFreeNum = 0;
     size_t treeFreeNum = 0;
-    size_t structSize = (MAXBINNUM + 1) * WSIZE; 
+    size_t structSize = STRUCTSIZE; 
     
-    /* Step 1: Check the heap */
+    /* Step 1: Check the heap, chunk by chunk */
     dbg_printf("Step 1: Checking the heap...\n");
-    /* 1.1 Check prologue block */
-    dbg_printf("Checking prologue block...\n");
-    ENSURES(GetSize(HDRP(heap_listp)) == DSIZE + structSize);
-    ENSURES(GetAlloc(heap_listp));
-    
-    /* 1.2 Check each middle block */
-    dbg_printf("Checking each middle block...\n");
-    for(bp = NextBlkp(heap_listp); GetSize(HDRP(bp)) != 0;
-        bp = NextBlkp(bp)){
-        checkBlock(bp);
-        if(!GetAlloc(bp)){
-            totalFreeNum++;
+    for(i = 0; i < num; i++){
+        prologue = ChunkAt(i);
+        if(&Arenas[Get(prologue)] != a) continue;
+        
+        /* 1.1 Check prologue block */
+        dbg_printf("Checking prologue block...\n");
+        if(prologue + ROOTOFF == a->Root){
+            ENSURES(GetSize(HDRP(prologue)) == PROLOGSIZE);
+        }
+        else{
+            ENSURES(GetSize(HDRP(prologue)) == DSIZE);
         }
+        ENSURES(GetAlloc(prologue));
+        
+        /* 1.2 Check each middle block */
+        dbg_printf("Checking each middle block...\n");
+        for(bp = NextBlkp(prologue); GetSize(HDRP(bp)) != 0;
+            bp = NextBlkp(bp)){
+            checkBlock(bp);
+            if(!GetAlloc(bp)){
+                totalFreeNum++;
+            }
+        }
+        
+        /* 1.3 Check epilogue block */
+        dbg_printf("Checking epilogue block...\n");
+        ENSURES(GetSize(HDRP(bp)) == 0);
+        ENSURES(GetAlloc(bp));
     }
     
-    /* 1.3 Check epilogue block */
-    dbg_printf("Checking epilogue block...\n");
-    ENSURES(GetSize(HDRP(bp)) == 0);
-    ENSURES(GetAlloc(bp));
-    
     
     /* Step 2: Check the segregated free list */
     dbg_printf("Step 2: Checking segregated free list...\n");
     
-    /* 2.1 Check segregated list */
+    /* 2.1 Check the bin layout: sizes rise, exact lists come */
+    /* first, then ranges, then trees */
+    for(i = 0; i <= MAXBINNUM; i++){
+        ENSURES(i == 0 || BinMax[i] > BinMax[i - 1]);
+        ENSURES(BinKind[i] == ((BinMax[i] <= DSIZE * (EXACTNUM + 1)) ? 0 :
+                               (i <= SEGNUM) ? 1 : 2));
+    }
+    
+    /* 2.2 Check segregated list */
     dbg_printf("Checking segregated list...\n");
     for(i = 0; i <= SEGNUM; i++){
         listFreeNum += checkList(i);
     }
     
     /* Step 3: Check the binary search tree */
+#ifdef TLSF
+    dbg_printf("Step 3: Checking TLSF index...\n");
+    treeFreeNum += checkTlsf();
+#else
     dbg_printf("Step 3: Checking binary search tree...\n");
     for(i = SEGNUM + 1; i <= MAXBINNUM; i++){
         treeFreeNum += checkTree(i);
     }
+#endif
     
     /* Step 4: Check total free number consistency */
     dbg_printf("Step 4: Checking total free number...\n");
     ENSURES(totalFreeNum == treeFreeNum + listFreeNum);
     
+    /* Step 5: Check the slab runs */
+    dbg_printf("Step 5: Checking slab runs...\n");
+    for(i = 0; i < SLABNUM; i++){
+        checkSlab(i);
+    }
+    
     
     structSize = structSize;
+    return 0;
+}
+
+/* Check the arena whose lock the caller holds, or every arena */
+/* Returns 0 if no errors were found, otherwise returns the error */
+int mm_checkheap(int verbose) {
+    
+    Arena *a;
+    size_t i;
+    int err = 0;
+    
     verbose = verbose;
+    if(CurArena != NULL){
+        return checkArena(CurArena);
+    }
+    
+    for(i = 0; i < ArenaNum && !err; i++){
+        ArenaLock(a = &Arenas[i]);
+        if(a->Root != NULL) err = checkArena(a);
+        ArenaUnlock(a);
+    }
+    return err;
+}
+
+#ifndef NDEBUG
+/* Check the links of a free block with its neighbours in its bin: */
+/* what checkList and checkTree check, one block at a time */
+void checkLinks(void *bp){
+    
+    size_t size = GetSize(HDRP(bp));
+    void *prev = PrevFreed(bp);
+    void *next = NextFreed(bp);
+    
+    /* Pointer consistency */
+    ENSURES(prev != NULL);
+    if(next != NULL){
+        ENSURES(in_heap(next));
+        ENSURES(PrevFreed(next) == bp);
+    }
+    
+#ifdef TLSF
+    if(size > BLKTHRES){
+        size_t fl = TlsfFl(size);
+        size_t sl = TlsfSl(size, fl);
+        
+        /* Linked from the head of its class, or from a block */
+        ENSURES(NextFreed(prev) == bp);
+        ENSURES(!IsEntrance(prev) || prev == TlsfHead(fl, sl));
+        ENSURES(((Get(TlsfSlMap(fl)) >> sl) & 1) && ((Get(TlsfFlMap()) >> fl) & 1));
+        return;
+    }
+#else
+    if(size > BLKTHRES && Get(LabelPtr(bp)) != SEGNODE){
+        void *left = LeftFreed(bp);
+        void *right = RightFreed(bp);
+        
+        /* Linked from its parent, or from the bin for a root */
+        if(Get(LabelPtr(bp)) == ROOT){
+            ENSURES(prev == GetBinAdd(GetBinInd(size)));
+            ENSURES(NextFreed(prev) == bp);
+        }
+        else{
+            ENSURES(Get(LabelPtr(bp)) == LEFT ? LeftFreed(prev) == bp :
+                    RightFreed(prev) == bp);
+            ENSURES(GetBinInd(GetSize(HDRP(prev))) == GetBinInd(size));
+        }
+        
+        /* Size and priority order with its children */
+        if(left != NULL){
+            ENSURES(PrevFreed(left) == bp && Get(LabelPtr(left)) == LEFT);
+            ENSURES(GetSize(HDRP(left)) < size);
+            ENSURES(Get(PrioPtr(left)) <= Get(PrioPtr(bp)));
+        }
+        if(right != NULL){
+            ENSURES(PrevFreed(right) == bp && Get(LabelPtr(right)) == RIGHT);
+            ENSURES(GetSize(HDRP(right)) > size);
+            ENSURES(Get(PrioPtr(right)) <= Get(PrioPtr(bp)));
+        }
+        
+        /* Same size blocks follow it */
+        if(next != NULL){
+            ENSURES(Get(LabelPtr(next)) == SEGNODE);
+            ENSURES(GetSize(HDRP(next)) == size);
+        }
+        return;
+    }
+#endif
+    
+    /* A list node: linked from the bin, or from a block of its bin */
+    ENSURES(NextFreed(prev) == bp);
+    if(IsEntrance(prev)){
+        ENSURES(prev == GetBinAdd(GetBinInd(size)));
+    }
+    else{
+        ENSURES(GetBinInd(GetSize(HDRP(prev))) == GetBinInd(size));
+    }
+    if(next != NULL){
+        ENSURES(GetBinInd(GetSize(HDRP(next))) == GetBinInd(size));
+    }
+}
+
+
+/* Check the blocks of the arena touched since the last check, and */
+/* the links of the free ones. The lock of the arena must be held */
+static int checkTouched(Arena *a){
+    
+    void *bp;
+    unsigned int i;
+    
+    dbg_printf("Checking %u touched blocks\n", a->TouchNum);
+    for(i = 0; i < a->TouchNum; i++){
+        bp = IntToPtr(a->Touched[i]);
+        ENSURES(in_heap(bp));
+        checkBlock(bp);
+        if(!GetAlloc(bp)){
+            checkLinks(bp);
+        }
+    }
     return 0;
 }
+
+
+/* Check the current arena before an allocation: the blocks touched */
+/* since the last check, or the whole arena one time in CheckRate */
+/* and when more blocks were touched than remembered */
+static int checkStep(void){
+    
+    Arena *a = CurArena;
+    int err;
+    
+    a->Checks++;
+    if(a->TouchNum > TOUCHMAX || (CheckRate != 0 && a->Checks % CheckRate == 0)){
+        err = checkArena(a);
+    }
+    else{
+        err = checkTouched(a);
+    }
+    a->TouchNum = 0;
+    return err;
+}
+#endif
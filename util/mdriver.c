@@ -0,0 +1,372 @@
+/*
+ * mdriver.c - replays allocation traces (see trace.h) against the
+ *		allocator and against libc, and reports for each its peak
+ *		footprint, utilization and throughput.
+ *
+ *	gcc -O2 -DDRIVER -DNDEBUG -Iutil -o mdriver mm.c util/memlib.c \
+ *		util/mdriver.c -lpthread
+ *	./mdriver [-n runs] [-m] app.trace ...
+ *
+ * Each trace is first replayed once untimed, checking that no object is
+ * overwritten while live and measuring the peak of the bytes requested
+ * and of the footprint: heap plus mapped chunks for mm, arenas plus
+ * mapped chunks as told by mallinfo for libc. Utilization is the ratio
+ * of the two peaks. Then it is replayed runs times (3 by default), and
+ * the fastest run gives the throughput. -m skips libc.
+ *
+ * Traces are replayed by one thread, in the order they were recorded.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "trace.h"
+
+/* An allocator under test */
+typedef struct {
+	const char *name;
+	void (*reset)(void);
+	size_t (*footprint)(void);
+	void *(*malloc)(size_t);
+	void (*free)(void *);
+	void *(*realloc)(void *, size_t);
+	void *(*calloc)(size_t, size_t);
+	int (*memalign)(void **, size_t, size_t);
+} alloc_t;
+
+/* A trace loaded in memory */
+typedef struct {
+	const char *name;
+	trace_op_t *ops;
+	size_t num;
+	size_t cap;			/* Records ops has room for */
+	size_t ids;			/* Highest id plus one */
+} trace_t;
+
+/* Outcome of replaying a trace */
+typedef struct {
+	size_t peak_payload;
+	size_t peak_footprint;
+	double secs;
+} result_t;
+
+static void **objs;		/* Object of every id */
+static size_t *sizes;		/* ... and its requested size */
+
+
+/*
+ * map_zero - map len zero bytes, so that the tables of the driver stay
+ *		out of the libc heap it measures. Exit if out of memory
+ */
+static void *map_zero(size_t len){
+	void *p = mmap(NULL, len ? len : 1, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (p == MAP_FAILED) {
+		perror("mdriver: mmap");
+		exit(1);
+	}
+	return p;
+}
+
+
+static void mm_reset(void){
+	mem_reset_brk();
+	if (mm_init() < 0) {
+		fprintf(stderr, "mdriver: mm_init failed\n");
+		exit(1);
+	}
+}
+
+static size_t mm_footprint(void){
+	mm_stats_t st;
+
+	mm_stats(&st);
+	return st.heap + st.mapped;
+}
+
+static void libc_reset(void){
+	malloc_trim(0);
+}
+
+static size_t libc_footprint(void){
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 mi = mallinfo2();
+#else
+	struct mallinfo mi = mallinfo();
+#endif
+	return (size_t)mi.arena + (size_t)mi.hblkhd;
+}
+
+static const alloc_t mm_alloc = {
+	"mm", mm_reset, mm_footprint,
+	mm_malloc, mm_free, mm_realloc, mm_calloc, mm_posix_memalign
+};
+
+static const alloc_t libc_alloc = {
+	"libc", libc_reset, libc_footprint,
+	malloc, free, realloc, calloc, posix_memalign
+};
+
+
+/*
+ * load_trace - read and check the trace at path. Return -1 if it cannot
+ *		be read or is malformed
+ */
+static int load_trace(const char *path, trace_t *t){
+	const unsigned char *p, *q, *end;
+	unsigned char *buf = NULL;
+	char *live = NULL;
+	trace_hdr_t hdr;
+	size_t len, cap = 0;
+	trace_op_t op;
+	long flen;
+	FILE *f;
+	int err = -1;
+
+	memset(t, 0, sizeof(*t));
+	t->name = path;
+	if ((f = fopen(path, "rb")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	flen = ftell(f);
+	rewind(f);
+	len = (flen > 0) ? (size_t)flen : 0;
+	if (len < sizeof(hdr) || fread(buf = map_zero(len), 1, len, f) != len) {
+		fprintf(stderr, "%s: cannot read trace\n", path);
+		goto out;
+	}
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION) {
+		fprintf(stderr, "%s: not a trace of version %d\n", path, TRACE_VERSION);
+		goto out;
+	}
+
+	/* Decode every record, following which ids are live. Records */
+	/* take at least two bytes, so that bounds their number */
+	t->cap = (len - sizeof(hdr)) / 2;
+	t->ops = map_zero(t->cap * sizeof(op));
+	live = calloc(1, 1);
+	for (p = buf + sizeof(hdr), end = buf + len; p < end; t->num++) {
+		if ((q = trace_decode(p, end, &op)) == NULL) {
+
+			/* The recorder was cut short while writing a record */
+			if (end - p < TRACE_MAXREC) {
+				fprintf(stderr, "%s: last record cut short\n", path);
+				break;
+			}
+			fprintf(stderr, "%s: bad record %zu\n", path, t->num);
+			goto out;
+		}
+		p = q;
+		if (op.id >= t->ids) {
+			t->ids = (size_t)op.id + 1;
+			if (t->ids > cap) {
+				live = realloc(live, 2 * t->ids);
+				memset(live + cap, 0, 2 * t->ids - cap);
+				cap = 2 * t->ids;
+			}
+		}
+		if ((op.op == TRACE_FREE || op.op == TRACE_REALLOC) != live[op.id]) {
+			fprintf(stderr, "%s: record %zu: object %u is %s\n", path,
+					t->num, op.id, live[op.id] ? "live" : "not live");
+			goto out;
+		}
+		live[op.id] = (op.op != TRACE_FREE);
+		t->ops[t->num] = op;
+	}
+	err = 0;
+out:
+	fclose(f);
+	if (buf != NULL)
+		munmap(buf, len);
+	if (err && t->ops != NULL)
+		munmap(t->ops, t->cap * sizeof(op));
+	free(live);
+	return err;
+}
+
+
+/*
+ * replay - run trace t against allocator a, return 0 on success. When
+ *		checked, objects are tagged with their id and the peaks are
+ *		measured, otherwise it is timed
+ */
+static int replay(const trace_t *t, const alloc_t *a, int checked, result_t *r){
+	size_t payload = 0, base, foot, i;
+	struct timespec t0, t1;
+	trace_op_t *op;
+	void *p;
+
+	a->reset();
+	base = a->footprint();
+	memset(r, 0, sizeof(*r));
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (i = 0; i < t->num; i++) {
+		op = &t->ops[i];
+		p = NULL;
+
+		/* A live object must still hold its tag */
+		if (checked && op->op != TRACE_MALLOC && op->op != TRACE_CALLOC &&
+				op->op != TRACE_MEMALIGN && sizes[op->id] >= sizeof(uint32_t) &&
+				*(uint32_t *)objs[op->id] != op->id) {
+			fprintf(stderr, "%s: %s: record %zu: object %u overwritten\n",
+					t->name, a->name, i, op->id);
+			return -1;
+		}
+
+		switch (op->op) {
+		case TRACE_MALLOC:
+			p = a->malloc(op->size);
+			break;
+		case TRACE_CALLOC:
+			p = a->calloc(op->arg, op->size);
+			break;
+		case TRACE_MEMALIGN:
+			if (a->memalign(&p, (op->arg < sizeof(void *)) ?
+					sizeof(void *) : op->arg, op->size) != 0)
+				p = NULL;
+			break;
+		case TRACE_REALLOC:
+			p = a->realloc(objs[op->id], op->size);
+			break;
+		case TRACE_FREE:
+			a->free(objs[op->id]);
+			objs[op->id] = NULL;
+			payload -= sizes[op->id];
+			sizes[op->id] = 0;
+			continue;
+		}
+		if (p == NULL && op->size > 0) {
+			fprintf(stderr, "%s: %s: record %zu: out of memory\n",
+					t->name, a->name, i);
+			return -1;
+		}
+
+		objs[op->id] = p;
+		if (checked) {
+			payload -= sizes[op->id];
+			sizes[op->id] = (op->op == TRACE_CALLOC) ?
+					op->arg * op->size : op->size;
+			payload += sizes[op->id];
+			if (sizes[op->id] >= sizeof(uint32_t))
+				*(uint32_t *)p = op->id;
+			if (payload > r->peak_payload)
+				r->peak_payload = payload;
+			if ((foot = a->footprint() - base) > r->peak_footprint)
+				r->peak_footprint = foot;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	r->secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	/* Free what the trace left, so that the next run starts clean */
+	for (i = 0; i < t->ids; i++) {
+		if (objs[i] != NULL)
+			a->free(objs[i]);
+		objs[i] = NULL;
+		sizes[i] = 0;
+	}
+	return 0;
+}
+
+
+/*
+ * evaluate - replay trace t against a, once checked then runs times,
+ *		and print a line of results. Return -1 if a run fails
+ */
+static int evaluate(const trace_t *t, const alloc_t *a, int runs,
+		double *secs){
+	result_t check, timed;
+	double best = 0;
+	int i;
+
+	if (replay(t, a, 1, &check))
+		return -1;
+	for (i = 0; i < runs; i++) {
+		if (replay(t, a, 0, &timed))
+			return -1;
+		if (i == 0 || timed.secs < best)
+			best = timed.secs;
+	}
+	*secs += best;
+	printf("  %-5s %5.1f%% %12zu %10.0f\n", a->name,
+			check.peak_footprint ?
+			100.0 * check.peak_payload / check.peak_footprint : 100.0,
+			check.peak_footprint, best > 0 ? t->num / best / 1e3 : 0);
+	return 0;
+}
+
+
+static void usage(void){
+	fprintf(stderr, "usage: mdriver [-n runs] [-m] trace ...\n"
+			"  -n runs  timed runs per trace, the fastest counts (3)\n"
+			"  -m       replay against mm only, not libc\n");
+	exit(2);
+}
+
+int main(int argc, char **argv){
+	double mm_secs = 0, libc_secs = 0;
+	size_t ops = 0;
+	int runs = 3, libc = 1, failed = 0;
+	trace_t t;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:m")) != -1) {
+		switch (c) {
+		case 'n':
+			if ((runs = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'm':
+			libc = 0;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind >= argc)
+		usage();
+
+	mem_init();
+	printf("%-7s %6s %12s %10s\n", "", "util", "peak bytes", "Kops/s");
+	for (; optind < argc; optind++) {
+		if (load_trace(argv[optind], &t)) {
+			failed = 1;
+			continue;
+		}
+		objs = map_zero(t.ids * sizeof(*objs));
+		sizes = map_zero(t.ids * sizeof(*sizes));
+		printf("%s: %zu ops\n", t.name, t.num);
+		if (evaluate(&t, &mm_alloc, runs, &mm_secs) ||
+				(libc && evaluate(&t, &libc_alloc, runs, &libc_secs)))
+			failed = 1;
+		else
+			ops += t.num;
+		munmap(objs, t.ids * sizeof(*objs));
+		munmap(sizes, t.ids * sizeof(*sizes));
+		munmap(t.ops, t.cap * sizeof(*t.ops));
+	}
+
+	if (ops > 0) {
+		printf("total: %zu ops\n", ops);
+		printf("  %-5s %31.0f\n", "mm", mm_secs > 0 ? ops / mm_secs / 1e3 : 0);
+		if (libc)
+			printf("  %-5s %31.0f\n", "libc",
+					libc_secs > 0 ? ops / libc_secs / 1e3 : 0);
+	}
+	mem_deinit();
+	return failed;
+}
@@ -17,22 +17,74 @@
 #include "memlib.h"
 #include "config.h"
 
+#define HUGE_PAGE (1UL<<21)	/* Huge page size, when built with -DHUGEPAGE */
+
 /* private variables */
 static char *heap;
 static char *mem_brk;
 static char *mem_max_addr;
+static size_t heap_page;		/* size of the pages backing the heap */
+
+static void mem_release(char *lo, char *hi);
+
+#ifdef HUGEPAGE
+/*
+ * mem_map_huge - map the heap with huge pages: explicit ones if enough
+ *		are reserved for the whole heap, else transparent ones on a 2MB
+ *		aligned range. Returns NULL if neither is available
+ */
+static char *mem_map_huge(void){
+	char *p, *aligned;
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		return p;
+#endif
+
+#ifdef MADV_HUGEPAGE
+	p = mmap((void *)0x800000000, MAX_HEAP + HUGE_PAGE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	aligned = (char *)(((uintptr_t)p + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+	if (aligned > p)
+		munmap(p, aligned - p);
+	munmap(aligned + MAX_HEAP, p + HUGE_PAGE - aligned);
+	if (madvise(aligned, MAX_HEAP, MADV_HUGEPAGE) == 0)
+		return aligned;
+	munmap(aligned, MAX_HEAP);
+#endif
+	return NULL;
+}
+#endif
 
 /*
  * mem_init - initialize the memory system model
  */
 void mem_init(void){
-	int dev_zero = open("/dev/zero", O_RDWR);
+	int dev_zero;
+
+#ifdef HUGEPAGE
+	if ((heap = mem_map_huge()) != NULL) {
+		heap_page = HUGE_PAGE;
+		mem_max_addr = heap + MAX_HEAP;
+		mem_brk = heap;
+		return;
+	}
+#endif
+
+	dev_zero = open("/dev/zero", O_RDWR);
 	heap = mmap((void *)0x800000000, /* suggested start*/
 			MAX_HEAP,				/* length */
 			PROT_WRITE,				/* permissions */
-			MAP_PRIVATE,			/* private or shared? */
+			MAP_PRIVATE | MAP_NORESERVE,	/* private or shared? */
 			dev_zero,				/* fd */
 			0);						/* offset (dunno) */
+	close(dev_zero);
+	heap_page = mem_pagesize();
 	mem_max_addr = heap + MAX_HEAP;
 	mem_brk = heap;					/* heap is empty initially */
 }
@@ -48,29 +100,86 @@ void mem_deinit(void){
  * mem_reset_brk - reset the simulated brk pointer to make an empty heap
  */
 void mem_reset_brk(){
+	mem_release(heap, mem_brk);
 	mem_brk = heap;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		by incr bytes and returns the start address of the new area. A
+ *		negative incr shrinks the heap and gives the pages above the
+ *		new break back to the system. The heap past the break always
+ *		reads as zero.
  */
-void *mem_sbrk(int incr) {
+void *mem_sbrk(intptr_t incr) {
 	char *old_brk = mem_brk;
 
     // call sbrk() in an attempt to have similar semantics as a real allocator.
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr) ||
-            sbrk(incr) == (void *) -1) {
+    // It is never shrunk, since libc may have grown the real break since.
+	if ( (mem_brk + incr < heap) || ((mem_brk + incr) > mem_max_addr) ||
+            (incr > 0 && sbrk(incr) == (void *) -1)) {
 		errno = ENOMEM;
 		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 		return (void *)-1;
 	}
 
 	mem_brk += incr;
+	if (incr < 0)
+		mem_release(mem_brk, old_brk);
 	return (void *)old_brk;
 }
 
+/*
+ * mem_purge - give the whole heap pages inside [start, start + len) back
+ *		to the system. They stay mapped and read as zero afterwards.
+ */
+void mem_purge(void *start, size_t len){
+	uintptr_t page = (uintptr_t)heap_page;
+	uintptr_t lo = ((uintptr_t)start + page - 1) / page * page;
+	uintptr_t hi = ((uintptr_t)start + len) / page * page;
+
+	if (hi > lo)
+		madvise((void *)lo, hi - lo, MADV_DONTNEED);
+}
+
+/*
+ * mem_prefault - fault in the pages of [start, start + len) ahead of
+ *		use, without changing their contents
+ */
+void mem_prefault(void *start, size_t len){
+	uintptr_t page = (uintptr_t)heap_page;
+	uintptr_t lo = (uintptr_t)start / page * page;
+	uintptr_t end = (uintptr_t)start + len;
+	volatile char *p;
+
+#ifdef MADV_POPULATE_WRITE
+	if (madvise((void *)lo, end - lo, MADV_POPULATE_WRITE) == 0)
+		return;
+#endif
+	/* Older kernels: write a byte of the range in every page to */
+	/* itself, bytes outside of it may be in use */
+	for (p = start; (uintptr_t)p < end; p = (char *)(lo += page))
+		*p = *p;
+}
+
+/*
+ * mem_release - clear [lo, hi), a range dropped from the heap, and give
+ *		its whole pages back to the system
+ */
+static void mem_release(char *lo, char *hi){
+	uintptr_t page = (uintptr_t)heap_page;
+	char *end = (char *)(((uintptr_t)lo + page - 1) / page * page);
+
+	if (end >= hi) {
+		memset(lo, 0, hi - lo);
+		return;
+	}
+
+	/* The page holding hi is all past the old break, thus zero */
+	memset(lo, 0, end - lo);
+	mem_purge(end, hi - end + page - 1);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -98,3 +207,11 @@ size_t mem_heapsize() {
 size_t mem_pagesize(){
 	return (size_t)getpagesize();
 }
+
+/*
+ * mem_heap_pagesize() - returns the size of the pages backing the heap,
+ *		which only go back to the system as a whole
+ */
+size_t mem_heap_pagesize(){
+	return heap_page;
+}
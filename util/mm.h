@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include "sizeclass.h"
 
 #ifdef DRIVER
 
@@ -7,6 +8,13 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_valloc(size_t size);
+extern void *mm_pvalloc(size_t size);
+extern void *mm_reallocarray(void *ptr, size_t nmemb, size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
 
 #else
 
@@ -15,11 +23,90 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern void *valloc(size_t size);
+extern void *pvalloc(size_t size);
+extern void *reallocarray(void *ptr, size_t nmemb, size_t size);
+extern size_t malloc_usable_size(void *ptr);
 
 #endif
 
 extern int mm_init(void);
 
+/* Allocate or free many objects at once */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Tunable parameters, set with mm_mallopt */
+#define MM_MMAP_THRESHOLD 1  /* Requests of at least this size are mmapped */
+#define MM_TRIM_THRESHOLD 2  /* Free heap top of this size is trimmed */
+#define MM_TOP_PAD 3         /* Free heap top kept when trimming */
+#define MM_PURGE_THRESHOLD 4 /* Free blocks of this size are purged, 0 never */
+#define MM_GROW_MAX 5        /* Cap of the heap growth step */
+#define MM_CHECK_RATE 6      /* One debug heap check in this many is full */
+#define MM_PROFILE_RATE 7    /* Mean bytes between heap profile samples, 0 off */
+#define MM_QUICK_BYTES 8     /* Freed bytes an arena defers coalescing of, 0 none */
+
+extern int mm_mallopt(int param, size_t value);
+extern int mm_trim(size_t pad);
+
+/* Grow the heap ahead of time, see mm_reserve */
+#define MM_RESERVE_PREFAULT 1  /* Fault the reserved pages in as well */
+
+extern int mm_reserve(size_t bytes, int flags);
+
+/* Allocator counters, read with mm_stats */
+#define MM_STATS_BINS MM_SC_NUM  /* Bins counted, see sizeclass.h */
+
+typedef struct {
+    unsigned long extends;  /* Times the heap grew */
+    unsigned long chunks;   /* ... by starting a new chunk */
+    unsigned long trims;    /* Times the heap shrank */
+    size_t grown;           /* Bytes the heap grew by */
+    size_t trimmed;         /* Bytes the heap shrank by */
+    size_t live;            /* Bytes in allocated blocks and mappings */
+    size_t heap;            /* Heap size */
+    size_t mapped;          /* Bytes in mapped chunks */
+    unsigned long bin_count[MM_STATS_BINS]; /* Free blocks per bin */
+    size_t bin_bytes[MM_STATS_BINS];        /* ... and their bytes */
+    unsigned long fit_exact;   /* Searches finding the very size */
+    unsigned long fit_closest; /* ... a larger block */
+    unsigned long fit_miss;    /* ... nothing */
+    unsigned long splits;      /* Blocks split when placed */
+    unsigned long coalesce[4]; /* Frees by coalescing case 1 to 4 */
+    unsigned long tree_depth;  /* Deepest insertion into a BST */
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *st);
+
+/* Heap profile of the objects sampled once MM_PROFILE_RATE is set */
+extern int mm_profile_dump(int fd);
+extern int mm_profile_signal(int sig, const char *prefix);
+
+/* A block of the heap, as told by mm_heap_walk */
+#define MM_BLOCK_ALLOC 0x1       /* Allocated, or held by a cache or quick list */
+#define MM_BLOCK_PREV_ALLOC 0x2  /* The block before it is allocated */
+#define MM_BLOCK_ZERO 0x4        /* Free and known to be zero */
+#define MM_BLOCK_SLAB 0x8        /* A run of slab slots */
+#define MM_BLOCK_NOBIN 0xff      /* Bin of a block in no bin */
+
+typedef struct {
+    void *ptr;              /* Its payload */
+    size_t size;            /* Its size, header included */
+    unsigned int flags;
+    unsigned int bin;       /* Bin of a free block, 0-3 lists, 4-5 the rest */
+    unsigned int arena;     /* Arena owning its chunk */
+} mm_block_t;
+
+/* Called for each block, under the lock of its arena: it must not */
+/* allocate or free. A non-zero return stops the walk */
+typedef int (*mm_walk_fn)(const mm_block_t *blk, void *arg);
+
+extern int mm_heap_walk(mm_walk_fn fn, void *arg);
+extern int mm_heap_snapshot(int fd);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern int mm_checkheap(int verbose);
@@ -0,0 +1,338 @@
+/*
+ * mmsnap.c - reads heap snapshots (see snapshot.h) taken by
+ *		mm_heap_snapshot, and reports where the free space of the heap
+ *		lies, or how it moved between two snapshots.
+ *
+ *	gcc -O2 -Iutil -o mmsnap util/mmsnap.c
+ *	./mmsnap [-w width] heap.snap
+ *	./mmsnap [-w width] -d old.snap new.snap
+ *
+ * For one snapshot it prints the allocated and free totals, the largest
+ * free extent, the free block sizes of each bin by power of two, and a
+ * map of the heap: one character per span of bytes, telling how much of
+ * it is free. With -d it prints how the totals and bins changed, and a
+ * map telling where blocks were allocated or freed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+#define BINS SNAP_NOBIN		/* Most bins of the allocator, see sizeclass.h */
+#define CLASSES 33			/* Power of two size classes of a histogram */
+#define MAPLINES 32			/* Most lines of a map */
+
+/* A snapshot loaded in memory */
+typedef struct {
+	const char *name;
+	snap_hdr_t hdr;
+	snap_rec_t *recs;
+	size_t num;
+} snap_t;
+
+/* Totals of a snapshot */
+typedef struct {
+	size_t blocks[2], bytes[2];	/* Free (0) and allocated (1) */
+	size_t slabs, slab_bytes;
+	size_t zero_bytes;
+	size_t largest;			/* Largest run of free bytes */
+	size_t largest_at;
+	size_t arenas;
+	int bins;				/* Highest bin holding a block, plus one */
+	size_t bin_blocks[BINS], bin_bytes[BINS];
+	size_t hist[BINS][CLASSES];	/* Free blocks per bin and size class */
+} summary_t;
+
+static int width = 64;		/* Characters per map line */
+
+
+/*
+ * load_snap - read and check the snapshot at path. Return -1 if it
+ *		cannot be read or is malformed
+ */
+static int load_snap(const char *path, snap_t *s){
+	long len;
+	FILE *f;
+
+	memset(s, 0, sizeof(*s));
+	s->name = path;
+	if ((f = fopen(path, "rb")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	if (len < (long)sizeof(s->hdr) || fread(&s->hdr, sizeof(s->hdr), 1, f) != 1 ||
+			s->hdr.magic != SNAP_MAGIC || s->hdr.version != SNAP_VERSION) {
+		fprintf(stderr, "%s: not a snapshot of version %d\n", path, SNAP_VERSION);
+		fclose(f);
+		return -1;
+	}
+	s->num = (len - sizeof(s->hdr)) / sizeof(snap_rec_t);
+	s->recs = malloc(s->num * sizeof(snap_rec_t) + 1);
+	if (s->recs == NULL || fread(s->recs, sizeof(snap_rec_t), s->num, f) != s->num) {
+		fprintf(stderr, "%s: cannot read snapshot\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Give a size, return its power of two class */
+static int size_class(size_t size){
+	int c = 0;
+
+	while (size >>= 1)
+		c++;
+	return (c < CLASSES) ? c : CLASSES - 1;
+}
+
+/* Give a record, return the offset of its payload in bytes */
+static inline size_t rec_start(const snap_rec_t *r){
+	return (size_t)r->offset * SNAP_UNIT;
+}
+
+
+/*
+ * summarize - add up the blocks of s into sum
+ */
+static void summarize(const snap_t *s, summary_t *sum){
+	const snap_rec_t *r;
+	size_t i;
+	int alloc;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < s->num; i++) {
+		r = &s->recs[i];
+		alloc = r->flags & SNAP_ALLOC;
+		sum->blocks[alloc]++;
+		sum->bytes[alloc] += r->size;
+		if (r->arena + 1U > sum->arenas)
+			sum->arenas = r->arena + 1U;
+		if (r->flags & SNAP_SLAB) {
+			sum->slabs++;
+			sum->slab_bytes += r->size;
+		}
+
+		/* Free blocks coalesce, and each chunk is closed by its */
+		/* prologue and epilogue, so a free block is a whole extent */
+		if (alloc)
+			continue;
+		if (r->flags & SNAP_ZERO)
+			sum->zero_bytes += r->size;
+		if (r->size > sum->largest) {
+			sum->largest = r->size;
+			sum->largest_at = rec_start(r);
+		}
+		if (r->bin < BINS) {
+			if (r->bin >= sum->bins)
+				sum->bins = r->bin + 1;
+			sum->bin_blocks[r->bin]++;
+			sum->bin_bytes[r->bin] += r->size;
+			sum->hist[r->bin][size_class(r->size)]++;
+		}
+	}
+}
+
+/* Return the percentage of free space outside of the largest extent */
+static double fragmentation(const summary_t *sum){
+	return sum->bytes[0] ? 100.0 * (sum->bytes[0] - sum->largest) / sum->bytes[0] : 0;
+}
+
+
+/*
+ * fill_map - add the free and allocated bytes of s to the spans of a
+ *		map, each span bytes long
+ */
+static void fill_map(const snap_t *s, size_t span, size_t *bytes[2], size_t spans){
+	size_t i, lo, hi, cut;
+	const snap_rec_t *r;
+
+	for (i = 0; i < s->num; i++) {
+		r = &s->recs[i];
+		for (lo = rec_start(r), hi = lo + r->size; lo < hi; lo = cut) {
+			cut = (lo / span + 1) * span;
+			if (cut > hi)
+				cut = hi;
+			if (lo / span < spans)
+				bytes[r->flags & SNAP_ALLOC][lo / span] += cut - lo;
+		}
+	}
+}
+
+/* Give a heap size, return the span of a map character: whole pages, */
+/* one at least, so that the map fits MAPLINES lines. An empty heap, */
+/* snapshot before the first allocation, gets an empty map */
+static size_t map_span(size_t heap){
+	size_t span = (heap + (size_t)width * MAPLINES - 1) / ((size_t)width * MAPLINES);
+
+	return (span > 4096) ? (span + 4095) / 4096 * 4096 : 4096;
+}
+
+/* Print the first offset of each map line, then its characters */
+static void print_map(const char *map, size_t spans, size_t span){
+	size_t i;
+
+	for (i = 0; i < spans; i += width)
+		printf("  %#12zx |%.*s|\n", i * span, (int)(spans - i < (size_t)width ?
+				spans - i : (size_t)width), map + i);
+}
+
+
+/*
+ * report - print the totals, bins and map of snapshot s
+ */
+static void report(const snap_t *s){
+	size_t span = map_span(s->hdr.heap);
+	size_t spans = (s->hdr.heap + span - 1) / span;
+	size_t *bytes[2];
+	summary_t sum;
+	size_t i, used;
+	char *map;
+	int b, c;
+
+	summarize(s, &sum);
+	printf("%s: heap of %zu bytes at %#llx, %zu blocks in %zu arenas\n",
+			s->name, (size_t)s->hdr.heap, (unsigned long long)s->hdr.base,
+			s->num, sum.arenas);
+	printf("  allocated %10zu blocks %14zu bytes, %zu slab runs of %zu bytes\n",
+			sum.blocks[1], sum.bytes[1], sum.slabs, sum.slab_bytes);
+	printf("  free      %10zu blocks %14zu bytes, %zu of them zero\n",
+			sum.blocks[0], sum.bytes[0], sum.zero_bytes);
+	printf("  largest free extent %zu bytes at %#zx, fragmentation %.1f%%\n",
+			sum.largest, sum.largest_at, fragmentation(&sum));
+
+	printf("free blocks per bin, by size class:\n");
+	for (b = 0; b < sum.bins; b++) {
+		printf("  bin %d %10zu blocks %14zu bytes\n", b, sum.bin_blocks[b],
+				sum.bin_bytes[b]);
+		for (c = 0; c < CLASSES; c++)
+			if (sum.hist[b][c])
+				printf("        [%zu, %zu) %zu\n", (size_t)1 << c,
+						(size_t)2 << c, sum.hist[b][c]);
+	}
+
+	/* Each character tells the free share of a span: '#' under */
+	/* a quarter, '+' under half, '-' under three quarters, '.' more, */
+	/* ' ' if no block covers it */
+	bytes[0] = calloc(spans + 1, sizeof(size_t));
+	bytes[1] = calloc(spans + 1, sizeof(size_t));
+	map = malloc(spans + 1);
+	fill_map(s, span, bytes, spans);
+	for (i = 0; i < spans; i++) {
+		used = bytes[0][i] + bytes[1][i];
+		map[i] = (used == 0) ? ' ' : (bytes[0][i] * 4 < used) ? '#' :
+				(bytes[0][i] * 2 < used) ? '+' : (bytes[0][i] * 4 < used * 3) ?
+				'-' : '.';
+	}
+	printf("map, %zu bytes per character ('#' full to '.' free):\n", span);
+	print_map(map, spans, span);
+	free(bytes[0]);
+	free(bytes[1]);
+	free(map);
+}
+
+
+/*
+ * diff - print how the totals, bins and blocks changed from snapshot
+ *		s to snapshot t
+ */
+static void diff(const snap_t *s, const snap_t *t){
+	size_t heap = (s->hdr.heap > t->hdr.heap) ? s->hdr.heap : t->hdr.heap;
+	size_t span = map_span(heap);
+	size_t spans = (heap + span - 1) / span;
+	size_t *old[2], *new[2];
+	summary_t a, b;
+	size_t i;
+	char *map;
+	int k;
+
+	summarize(s, &a);
+	summarize(t, &b);
+	printf("%s -> %s\n", s->name, t->name);
+	printf("  %-20s %14s %14s %15s\n", "", "old", "new", "change");
+	printf("  %-20s %14zu %14zu %+15lld\n", "heap bytes", (size_t)s->hdr.heap,
+			(size_t)t->hdr.heap, (long long)t->hdr.heap - (long long)s->hdr.heap);
+	printf("  %-20s %14zu %14zu %+15lld\n", "allocated bytes", a.bytes[1],
+			b.bytes[1], (long long)b.bytes[1] - (long long)a.bytes[1]);
+	printf("  %-20s %14zu %14zu %+15lld\n", "free bytes", a.bytes[0],
+			b.bytes[0], (long long)b.bytes[0] - (long long)a.bytes[0]);
+	printf("  %-20s %14zu %14zu %+15lld\n", "free blocks", a.blocks[0],
+			b.blocks[0], (long long)b.blocks[0] - (long long)a.blocks[0]);
+	printf("  %-20s %14zu %14zu %+15lld\n", "largest free extent",
+			a.largest, b.largest, (long long)b.largest - (long long)a.largest);
+	printf("  %-20s %13.1f%% %13.1f%% %+14.1f%%\n", "fragmentation",
+			fragmentation(&a), fragmentation(&b),
+			fragmentation(&b) - fragmentation(&a));
+	for (k = 0; k < a.bins || k < b.bins; k++)
+		printf("  bin %d %-14s %14zu %14zu %+15lld\n", k, "free blocks",
+				a.bin_blocks[k], b.bin_blocks[k],
+				(long long)b.bin_blocks[k] - (long long)a.bin_blocks[k]);
+
+	/* Each character tells how the allocated bytes of a span */
+	/* changed: '+' more, '-' fewer, '=' as many, ' ' no block */
+	for (k = 0; k < 2; k++) {
+		old[k] = calloc(spans + 1, sizeof(size_t));
+		new[k] = calloc(spans + 1, sizeof(size_t));
+	}
+	map = malloc(spans + 1);
+	fill_map(s, span, old, spans);
+	fill_map(t, span, new, spans);
+	for (i = 0; i < spans; i++) {
+		map[i] = (old[0][i] + old[1][i] + new[0][i] + new[1][i] == 0) ? ' ' :
+				(new[1][i] > old[1][i]) ? '+' : (new[1][i] < old[1][i]) ? '-' : '=';
+	}
+	printf("map, %zu bytes per character ('+' allocated, '-' freed):\n", span);
+	print_map(map, spans, span);
+	for (k = 0; k < 2; k++) {
+		free(old[k]);
+		free(new[k]);
+	}
+	free(map);
+}
+
+
+static void usage(void){
+	fprintf(stderr, "usage: mmsnap [-w width] snapshot\n"
+			"       mmsnap [-w width] -d old new\n"
+			"  -w width  characters per map line (64)\n"
+			"  -d        compare two snapshots\n");
+	exit(2);
+}
+
+int main(int argc, char **argv){
+	snap_t s, t;
+	int c, compare = 0;
+
+	while ((c = getopt(argc, argv, "w:d")) != -1) {
+		switch (c) {
+		case 'w':
+			if ((width = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'd':
+			compare = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1 + compare)
+		usage();
+
+	if (load_snap(argv[optind], &s))
+		return 1;
+	if (!compare) {
+		report(&s);
+		return 0;
+	}
+	if (load_snap(argv[optind + 1], &t))
+		return 1;
+	diff(&s, &t);
+	return 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * mmspec.c - derives a bin layout (see sizeclass.h) for mm.c from the
+ *		block sizes of recorded traces or heap snapshots.
+ *
+ *	gcc -O2 -Iutil -o mmspec util/mmspec.c
+ *	./mmspec [-p percent] [-e exact] [-r ranges] [-t trees] file ... > sc.h
+ *	gcc -include sc.h ... mm.c ...
+ *
+ * A trace (see trace.h) counts the block size of every allocation, a
+ * snapshot (see snapshot.h) that of every free block, which is what the
+ * bins hold. Sizes are rounded as mm.c rounds them.
+ *
+ * Every size from 16 bytes up to the largest one that makes percent of
+ * the count (1 by default) gets an exact list, up to exact lists (32). The
+ * sizes above are split in ranges + trees classes (0 + 2 by default) of
+ * about the same count, the range lists first. The last tree takes every
+ * size past the others.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "snapshot.h"
+
+#define DSIZE 8
+#define SIZEMAX (1 << 20)		/* Sizes past this are counted together */
+#define SLOTS (SIZEMAX / DSIZE + 1)	/* Histogram slots, one per size */
+#define CLASSMAX 250			/* Most classes of a layout */
+#define SIZELAST 0xFFFFFFFFUL	/* Largest size of the last class */
+
+/* A class of the layout */
+typedef struct {
+	char kind;				/* 'E'xact, 'R'ange or 'T'ree */
+	size_t max;				/* Largest size it holds */
+} class_t;
+
+static size_t hist[SLOTS];	/* Count of every block size */
+static size_t total;
+
+
+/* Give a request size, return the block size mm.c makes of it */
+static size_t block_size(size_t size){
+	if (size <= DSIZE + 4)
+		return 2 * DSIZE;
+	return DSIZE * ((size + 4 + DSIZE - 1) / DSIZE);
+}
+
+static void count(size_t size){
+	size_t slot = size / DSIZE;
+
+	hist[(slot < SLOTS) ? slot : SLOTS - 1]++;
+	total++;
+}
+
+
+/*
+ * load_file - count the block sizes of the trace or snapshot at path.
+ *		Return -1 if it cannot be read or is neither
+ */
+static int load_file(const char *path){
+	const unsigned char *p, *end;
+	unsigned char *buf;
+	snap_rec_t rec;
+	trace_op_t op;
+	uint32_t magic;
+	size_t len, i, bytes;
+	long flen;
+	FILE *f;
+
+	if ((f = fopen(path, "rb")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	flen = ftell(f);
+	rewind(f);
+	len = (flen > 0) ? (size_t)flen : 0;
+	if ((buf = malloc(len + 1)) == NULL || fread(buf, 1, len, f) != len ||
+			len < sizeof(magic)) {
+		fprintf(stderr, "%s: cannot read file\n", path);
+		fclose(f);
+		free(buf);
+		return -1;
+	}
+	fclose(f);
+	memcpy(&magic, buf, sizeof(magic));
+
+	if (magic == TRACE_MAGIC && len >= sizeof(trace_hdr_t)) {
+		for (p = buf + sizeof(trace_hdr_t), end = buf + len; p < end; ) {
+			if ((p = trace_decode(p, end, &op)) == NULL)
+				break;	/* Cut short, like mdriver takes it */
+			switch (op.op) {
+			case TRACE_MALLOC:
+			case TRACE_REALLOC:
+				count(block_size(op.size ? op.size : 1));
+				break;
+			case TRACE_CALLOC:
+				bytes = op.arg * op.size;
+				count(block_size(bytes ? bytes : 1));
+				break;
+			case TRACE_MEMALIGN:
+				count(block_size((op.size > 40) ? op.size : 41));
+				break;
+			}
+		}
+	}
+	else if (magic == SNAP_MAGIC && len >= sizeof(snap_hdr_t)) {
+		for (i = sizeof(snap_hdr_t); i + sizeof(rec) <= len; i += sizeof(rec)) {
+			memcpy(&rec, buf + i, sizeof(rec));
+			if (!(rec.flags & (SNAP_ALLOC | SNAP_SLAB)))
+				count(rec.size);
+		}
+	}
+	else {
+		fprintf(stderr, "%s: neither a trace nor a snapshot\n", path);
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	return 0;
+}
+
+
+/*
+ * derive - fill cls with the layout for the counted sizes, return the
+ *		number of classes
+ */
+static int derive(double percent, int exact, int ranges, int trees,
+		class_t *cls){
+	size_t last = 3 * DSIZE, rest = 0, sum = 0, slot, max;
+	int n = 0, k, parts = ranges + trees;
+
+	/* Exact lists up to the last frequent size, 16 and 24 at least */
+	for (slot = 2; slot < (size_t)exact + 2; slot++)
+		if (hist[slot] > 0 && hist[slot] >= percent / 100 * total)
+			last = slot * DSIZE;
+	for (slot = 2; slot * DSIZE <= last; slot++) {
+		cls[n].kind = 'E';
+		cls[n++].max = slot * DSIZE;
+	}
+
+	/* The rest is cut where the count passes each share */
+	for (slot = last / DSIZE + 1; slot < SLOTS; slot++)
+		rest += hist[slot];
+	for (k = 1, slot = last / DSIZE + 1; k < parts && slot < SLOTS - 1; slot++) {
+		sum += hist[slot];
+		if (sum * parts < rest * k)
+			continue;
+		max = slot * DSIZE;
+		cls[n].kind = (k <= ranges) ? 'R' : 'T';
+		cls[n++].max = max;
+		while (k < parts && sum * parts >= rest * k)
+			k++;
+	}
+
+	/* The last class is a tree taking every size past the others */
+	cls[n].kind = 'T';
+	cls[n++].max = SIZELAST;
+	return n;
+}
+
+/* Return the count of sizes in cls[i] */
+static size_t class_count(const class_t *cls, int i){
+	size_t lo = (i == 0) ? 0 : cls[i - 1].max / DSIZE + 1;
+	size_t hi = cls[i].max / DSIZE, slot, n = 0;
+
+	for (slot = lo; slot <= hi && slot < SLOTS; slot++)
+		n += hist[slot];
+	return n;
+}
+
+/* Write class c to buf as it goes in the definition */
+static const char *class_name(const class_t *c, char *buf, size_t len){
+	const char *kind = (c->kind == 'E') ? "EXACT" : (c->kind == 'R') ? "RANGE" : "TREE";
+
+	if (c->max == SIZELAST)
+		snprintf(buf, len, "%s(0x%lX)", kind, (unsigned long)c->max);
+	else
+		snprintf(buf, len, "%s(%lu)", kind, (unsigned long)c->max);
+	return buf;
+}
+
+/*
+ * emit - print the layout as a definition of MM_SIZECLASSES, along with
+ *		the share of the sizes each class takes
+ */
+static void emit(const class_t *cls, int n){
+	char buf[32];
+	int i;
+
+	printf("/*\n * Size classes derived by mmspec from %zu block sizes, "
+			"see sizeclass.h.\n * Share of the sizes per class:\n", total);
+	for (i = 0; i < n; i++)
+		printf(" *\t%-18s %5.1f%%\n", class_name(&cls[i], buf, sizeof(buf)),
+				100.0 * class_count(cls, i) / total);
+	printf(" */\n#define MM_SIZECLASSES(EXACT, RANGE, TREE) \\\n\t");
+	for (i = 0; i < n; i++)
+		printf("%s%s", class_name(&cls[i], buf, sizeof(buf)),
+				(i == n - 1) ? "\n" : (i % 6 == 5) ? " \\\n\t" : " ");
+}
+
+static void usage(void){
+	fprintf(stderr, "usage: mmspec [-p percent] [-e exact] [-r ranges] [-t trees] "
+			"file ...\n"
+			"  -p percent  least share of a size given an exact list (1)\n"
+			"  -e exact    most exact lists (32)\n"
+			"  -r ranges   range lists past the exact ones (0)\n"
+			"  -t trees    trees past the lists (2)\n");
+	exit(2);
+}
+
+int main(int argc, char **argv){
+	class_t cls[CLASSMAX];
+	double percent = 1;
+	int exact = 32, ranges = 0, trees = 2;
+	int c, n;
+
+	while ((c = getopt(argc, argv, "p:e:r:t:")) != -1) {
+		switch (c) {
+		case 'p':
+			percent = atof(optarg);
+			break;
+		case 'e':
+			exact = atoi(optarg);
+			break;
+		case 'r':
+			ranges = atoi(optarg);
+			break;
+		case 't':
+			trees = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind >= argc || percent < 0 || exact < 2 || ranges < 0 || trees < 1 ||
+			exact + ranges + trees >= CLASSMAX)
+		usage();
+
+	for (; optind < argc; optind++)
+		if (load_file(argv[optind]))
+			return 1;
+	if (total == 0) {
+		fprintf(stderr, "mmspec: no block sizes\n");
+		return 1;
+	}
+	n = derive(percent, exact, ranges, trees, cls);
+	emit(cls, n);
+	return 0;
+}
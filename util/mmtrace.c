@@ -0,0 +1,455 @@
+/*
+ * mmtrace.c - an allocation trace recorder. Preloaded into a process,
+ *		it passes every malloc, free, realloc, calloc and aligned
+ *		allocation on to libc and records it in the format of trace.h.
+ *
+ *	gcc -O2 -shared -fPIC -o mmtrace.so util/mmtrace.c -ldl -lpthread
+ *	MMTRACE=app.trace LD_PRELOAD=./mmtrace.so ./app
+ *
+ * The trace goes to $MMTRACE, or mm.trace if unset. Calls from every
+ * thread are serialized into one trace, in the order they took effect.
+ * Child processes are not traced. The recorder itself never allocates
+ * from libc: its tables are mapped directly.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+#define TRACE_BUF (1<<16)	/* Bytes buffered before a write */
+#define BOOT_HEAP 4096		/* Served while libc is being looked up */
+
+/* libc functions */
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static unsigned char trace_buf[TRACE_BUF];
+static size_t trace_len;
+
+/* dlsym may allocate before libc is found */
+static int resolving;
+static char boot_heap[BOOT_HEAP] __attribute__((aligned(16)));
+static size_t boot_brk;
+
+/* Live objects: an open addressing table from address to id */
+typedef struct {
+	uintptr_t ptr;		/* 0 if empty, 1 if deleted */
+	uint32_t id;
+} slot_t;
+
+static slot_t *id_tab;
+static size_t id_cap;		/* Slots, a power of two */
+static size_t id_used;		/* Slots not empty */
+static size_t id_live;		/* Slots in use */
+
+/* Ids of freed objects, reused before new ones */
+static uint32_t *id_free;
+static size_t id_nfree, id_freecap;
+static uint32_t id_next;
+
+/*
+ * map_resize - resize a mapping of old bytes to len bytes, keeping its
+ *		contents. Return NULL on failure
+ */
+static void *map_resize(void *p, size_t old, size_t len){
+	if (p == NULL)
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	else
+		p = mremap(p, old, len, MREMAP_MAYMOVE);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+static inline size_t id_hash(uintptr_t ptr){
+	ptr >>= 4;
+	return (size_t)(ptr * 0x9e3779b97f4a7c15ULL);
+}
+
+/*
+ * id_rehash - move the live objects into a table of cap slots
+ */
+static int id_rehash(size_t cap){
+	slot_t *tab = map_resize(NULL, 0, cap * sizeof(slot_t));
+	size_t i, j;
+
+	if (tab == NULL)
+		return -1;
+	for (i = 0; i < id_cap; i++) {
+		if (id_tab[i].ptr <= 1)
+			continue;
+		for (j = id_hash(id_tab[i].ptr) & (cap - 1); tab[j].ptr != 0;
+				j = (j + 1) & (cap - 1))
+			;
+		tab[j] = id_tab[i];
+	}
+	if (id_tab != NULL)
+		munmap(id_tab, id_cap * sizeof(slot_t));
+	id_tab = tab;
+	id_cap = cap;
+	id_used = id_live;
+	return 0;
+}
+
+/*
+ * id_insert - record ptr as a live object with the given id
+ */
+static int id_insert(void *ptr, uint32_t id){
+	size_t j;
+
+	if (2 * (id_used + 1) > id_cap &&
+			id_rehash((4 * (id_live + 1) > id_cap) ? 2 * id_cap : id_cap))
+		return -1;
+	for (j = id_hash((uintptr_t)ptr) & (id_cap - 1); id_tab[j].ptr > 1;
+			j = (j + 1) & (id_cap - 1))
+		;
+	if (id_tab[j].ptr == 0)
+		id_used++;
+	id_tab[j].ptr = (uintptr_t)ptr;
+	id_tab[j].id = id;
+	id_live++;
+	return 0;
+}
+
+/*
+ * id_remove - drop ptr from the live objects, return its id, or -1 if
+ *		it was not allocated while tracing
+ */
+static int64_t id_remove(void *ptr){
+	size_t j;
+
+	if (id_cap == 0)
+		return -1;
+	for (j = id_hash((uintptr_t)ptr) & (id_cap - 1); id_tab[j].ptr != 0;
+			j = (j + 1) & (id_cap - 1)) {
+		if (id_tab[j].ptr == (uintptr_t)ptr) {
+			id_tab[j].ptr = 1;
+			id_live--;
+			return id_tab[j].id;
+		}
+	}
+	return -1;
+}
+
+/*
+ * id_take - give out an id for a new object
+ */
+static int64_t id_take(void){
+	if (id_nfree > 0)
+		return id_free[--id_nfree];
+	if (id_next == UINT32_MAX)
+		return -1;
+	return id_next++;
+}
+
+/*
+ * id_give - put back the id of a freed object
+ */
+static void id_give(uint32_t id){
+	uint32_t *p;
+
+	if (id_nfree == id_freecap) {
+		p = map_resize(id_free, id_freecap * sizeof(uint32_t),
+				(id_freecap ? 2 * id_freecap : 1024) * sizeof(uint32_t));
+		if (p == NULL)
+			return;
+		id_free = p;
+		id_freecap = id_freecap ? 2 * id_freecap : 1024;
+	}
+	id_free[id_nfree++] = id;
+}
+
+/*
+ * trace_flush - write out the buffered records. The lock must be held
+ */
+static void trace_flush(void){
+	size_t off = 0;
+	ssize_t n;
+
+	while (trace_fd >= 0 && off < trace_len) {
+		n = write(trace_fd, trace_buf + off, trace_len - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		off += n;
+	}
+	trace_len = 0;
+}
+
+/*
+ * trace_put - buffer a record. The lock must be held
+ */
+static void trace_put(const trace_op_t *op){
+	if (trace_len + TRACE_MAXREC > TRACE_BUF)
+		trace_flush();
+	trace_len += trace_encode(trace_buf + trace_len, op);
+}
+
+/*
+ * trace_alloc - record the allocation of ptr by op. A resized object
+ *		keeps its id, or -1 for a new object
+ */
+static void trace_alloc(trace_op_t *op, void *ptr, int64_t id){
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd < 0)
+		goto out;
+	if (op->op == TRACE_REALLOC && id < 0)
+		op->op = TRACE_MALLOC;		/* Resized an untraced object */
+	if (id < 0 && (id = id_take()) < 0)
+		goto out;
+	op->id = (uint32_t)id;
+	if (id_insert(ptr, (uint32_t)id)) {
+		if (op->op == TRACE_REALLOC) {
+			op->op = TRACE_FREE;
+			trace_put(op);
+		}
+		id_give((uint32_t)id);
+		goto out;
+	}
+	trace_put(op);
+out:
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * trace_detach - take ptr out of the live objects before libc resizes
+ *		it, return its id or -1. trace_attach puts it back if libc fails
+ */
+static int64_t trace_detach(void *ptr){
+	int64_t id;
+
+	pthread_mutex_lock(&trace_lock);
+	id = id_remove(ptr);
+	pthread_mutex_unlock(&trace_lock);
+	return id;
+}
+
+static void trace_attach(void *ptr, int64_t id){
+	if (id < 0)
+		return;
+	pthread_mutex_lock(&trace_lock);
+	if (id_insert(ptr, (uint32_t)id))
+		id_give((uint32_t)id);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * trace_free - record the free of ptr
+ */
+static void trace_free(void *ptr){
+	trace_op_t op = { TRACE_FREE, 0, 0, 0 };
+	int64_t id;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd >= 0 && (id = id_remove(ptr)) >= 0) {
+		op.id = (uint32_t)id;
+		trace_put(&op);
+		id_give((uint32_t)id);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_atfork_prepare(void){
+	pthread_mutex_lock(&trace_lock);
+}
+
+static void trace_atfork_parent(void){
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/* The child shares the file, but not the objects */
+static void trace_atfork_child(void){
+	if (trace_fd >= 0)
+		close(trace_fd);
+	trace_fd = -1;
+	trace_len = 0;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * trace_init - look up libc and open the trace. Return -1 while the
+ *		lookup itself is allocating
+ */
+static int trace_init(void){
+	trace_hdr_t hdr = { TRACE_MAGIC, TRACE_VERSION };
+	const char *path = NULL;
+	int first = 0, err = 0;
+
+	if (resolving)
+		return -1;
+	resolving = 1;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_memalign = dlsym(RTLD_NEXT, "memalign");
+	real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+	real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+	resolving = 0;
+	if (real_malloc == NULL || real_free == NULL || real_realloc == NULL ||
+			real_calloc == NULL || real_memalign == NULL) {
+		fprintf(stderr, "mmtrace: libc allocator not found\n");
+		abort();
+	}
+
+	/* Threads may race here at startup, only one opens the trace */
+	pthread_mutex_lock(&trace_lock);
+	if (id_cap == 0 && id_rehash(1024) == 0) {
+		first = 1;
+		if ((path = getenv("MMTRACE")) == NULL)
+			path = "mm.trace";
+		trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (trace_fd >= 0) {
+			memcpy(trace_buf, &hdr, sizeof(hdr));
+			trace_len = sizeof(hdr);
+		}
+		else
+			err = errno;
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	/* Outside the lock, as these may allocate */
+	if (err)
+		fprintf(stderr, "mmtrace: cannot open %s: %s\n", path, strerror(err));
+	if (first)
+		pthread_atfork(trace_atfork_prepare, trace_atfork_parent,
+				trace_atfork_child);
+	return 0;
+}
+
+__attribute__((destructor))
+static void trace_fini(void){
+	pthread_mutex_lock(&trace_lock);
+	trace_flush();
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * boot_alloc - serve dlsym from a static buffer
+ */
+static void *boot_alloc(size_t size){
+	void *p;
+
+	size = (size + 15) & ~(size_t)15;
+	if (size > BOOT_HEAP - boot_brk)
+		return NULL;
+	p = boot_heap + boot_brk;
+	boot_brk += size;
+	return p;
+}
+
+static inline int is_boot(void *ptr){
+	return (char *)ptr >= boot_heap && (char *)ptr < boot_heap + BOOT_HEAP;
+}
+
+
+void *malloc(size_t size){
+	trace_op_t op = { TRACE_MALLOC, 0, size, 0 };
+	void *p;
+
+	if (real_malloc == NULL && trace_init())
+		return boot_alloc(size);
+	if ((p = real_malloc(size)) != NULL)
+		trace_alloc(&op, p, -1);
+	return p;
+}
+
+void free(void *ptr){
+	if (ptr == NULL || is_boot(ptr))
+		return;
+	trace_free(ptr);
+	real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size){
+	trace_op_t op = { TRACE_REALLOC, 0, size, 0 };
+	size_t len;
+	int64_t id;
+	void *p;
+
+	if (ptr == NULL)
+		return malloc(size);
+	if (is_boot(ptr)) {
+		len = boot_heap + BOOT_HEAP - (char *)ptr;
+		if ((p = malloc(size)) != NULL)
+			memcpy(p, ptr, (size < len) ? size : len);
+		return p;
+	}
+	if (size == 0) {
+		free(ptr);
+		return NULL;
+	}
+
+	/* Detach the object first, since its old address may be */
+	/* given out again as soon as libc moves it */
+	id = trace_detach(ptr);
+	if ((p = real_realloc(ptr, size)) == NULL) {
+		trace_attach(ptr, id);
+		return NULL;
+	}
+	trace_alloc(&op, p, id);
+	return p;
+}
+
+void *calloc(size_t nmemb, size_t size){
+	trace_op_t op = { TRACE_CALLOC, 0, size, nmemb };
+	void *p;
+
+	if (real_calloc == NULL && trace_init()) {
+		if (size && nmemb > SIZE_MAX / size)
+			return NULL;
+		return boot_alloc(nmemb * size);	/* Static, thus zero */
+	}
+	if ((p = real_calloc(nmemb, size)) != NULL)
+		trace_alloc(&op, p, -1);
+	return p;
+}
+
+void *memalign(size_t align, size_t size){
+	trace_op_t op = { TRACE_MEMALIGN, 0, size, align };
+	void *p;
+
+	if (real_memalign == NULL && trace_init())
+		return NULL;
+	if ((p = real_memalign(align, size)) != NULL)
+		trace_alloc(&op, p, -1);
+	return p;
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size){
+	trace_op_t op = { TRACE_MEMALIGN, 0, size, align };
+	int err;
+
+	if (real_posix_memalign == NULL && (trace_init() || !real_posix_memalign))
+		return ENOMEM;
+	if ((err = real_posix_memalign(memptr, align, size)) == 0)
+		trace_alloc(&op, *memptr, -1);
+	return err;
+}
+
+void *aligned_alloc(size_t align, size_t size){
+	trace_op_t op = { TRACE_MEMALIGN, 0, size, align };
+	void *p;
+
+	if (real_aligned_alloc == NULL && (trace_init() || !real_aligned_alloc))
+		return NULL;
+	if ((p = real_aligned_alloc(align, size)) != NULL)
+		trace_alloc(&op, p, -1);
+	return p;
+}
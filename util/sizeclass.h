@@ -0,0 +1,42 @@
+/*
+ * sizeclass.h - the bin layout of mm.c: which sizes of free blocks each
+ *		bin holds, and how it is searched.
+ *
+ * MM_SIZECLASSES lists the bins in increasing size order, each one by its
+ * kind and the largest block size it holds. A bin holds the sizes above
+ * the largest of the bin before it. The kinds are:
+ *
+ *	EXACT(s)	a list of blocks of s bytes only, taken without a search.
+ *			Exact bins come first, for 16, 24, 32 ... bytes in turn
+ *	RANGE(s)	a list of blocks of several sizes, searched first fit
+ *	TREE(s)		a treap, or the TLSF index when built with -DTLSF,
+ *			searched best fit
+ *
+ * Lists come before trees, and must take the blocks of 16 and 24 bytes,
+ * which have no room for tree links. The last bin is a tree that goes up
+ * to 0xFFFFFFFF. Another layout is built by defining MM_SIZECLASSES before
+ * this file is read, e.g. with gcc -include on the output of mmspec.c;
+ * code reading mm_stats must be built with the same one.
+ */
+#ifndef SIZECLASS_H
+#define SIZECLASS_H
+
+#ifndef MM_SIZECLASSES
+#define MM_SIZECLASSES(EXACT, RANGE, TREE) \
+	EXACT(16) EXACT(24) EXACT(32) EXACT(40) \
+	TREE(64) TREE(0xFFFFFFFF)
+#endif
+
+/* Folds of the list into constants: a count, or the last size */
+#define MM_SC_ONE(s) + 1
+#define MM_SC_NONE(s)
+#define MM_SC_LAST(s) * 0 + (s)
+
+#define MM_SC_NUM (0 MM_SIZECLASSES(MM_SC_ONE, MM_SC_ONE, MM_SC_ONE))
+#define MM_SC_EXACTS (0 MM_SIZECLASSES(MM_SC_ONE, MM_SC_NONE, MM_SC_NONE))
+#define MM_SC_LISTS (0 MM_SIZECLASSES(MM_SC_ONE, MM_SC_ONE, MM_SC_NONE))
+#define MM_SC_EXACTMAX (0 MM_SIZECLASSES(MM_SC_LAST, MM_SC_NONE, MM_SC_NONE))
+#define MM_SC_LISTMAX (0 MM_SIZECLASSES(MM_SC_LAST, MM_SC_LAST, MM_SC_NONE))
+#define MM_SC_MAX (0 MM_SIZECLASSES(MM_SC_LAST, MM_SC_LAST, MM_SC_LAST))
+
+#endif
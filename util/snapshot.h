@@ -0,0 +1,44 @@
+/*
+ * snapshot.h - the binary format of heap snapshots, written by
+ *		mm_heap_snapshot and read by the analyzer (mmsnap.c).
+ *
+ * A snapshot is a header followed by one fixed size record per block,
+ * in the order of mm_heap_walk: chunk by chunk in address order, and
+ * block by block within a chunk. Prologues and epilogues are left out,
+ * so chunks show as gaps between records. Fields are in host order, a
+ * snapshot is read on the machine that took it.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#define SNAP_MAGIC 0x4e534d4dU	/* "MMSN" */
+#define SNAP_VERSION 1
+
+#define SNAP_UNIT 8			/* Offsets count units of this many bytes */
+#define SNAP_NOBIN 0xff		/* Bin of a block in no bin */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t base;			/* Address of the heap start */
+	uint64_t heap;			/* Heap size when the snapshot began */
+} snap_hdr_t;
+
+/* Flags of a block */
+#define SNAP_ALLOC 0x1		/* Allocated, or held by a cache or quick list */
+#define SNAP_PREV_ALLOC 0x2	/* The block before it is allocated */
+#define SNAP_ZERO 0x4		/* Free and known to be zero */
+#define SNAP_SLAB 0x8		/* A run of slab slots */
+
+typedef struct {
+	uint32_t offset;		/* Of its payload from the heap start */
+	uint32_t size;			/* In bytes, header included */
+	uint8_t flags;
+	uint8_t bin;			/* Bin of a free block, else SNAP_NOBIN */
+	uint8_t arena;			/* Arena owning its chunk */
+	uint8_t pad;
+} snap_rec_t;
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * trace.h - the binary format of allocation traces, written by the
+ *		recorder (mmtrace.c) and replayed by the driver (mdriver.c).
+ *
+ * A trace is a header followed by one record per successful call:
+ *
+ *	[op: 1 byte][id][size]			malloc, realloc
+ *	[op: 1 byte][id]				free
+ *	[op: 1 byte][id][nmemb][size]	calloc
+ *	[op: 1 byte][id][align][size]	memalign and friends
+ *
+ * Every field after the op is a varint: 7 bits per byte, low bits first,
+ * the top bit set on all but the last byte. An id names an object from
+ * its allocation to its free; realloc keeps the id of its object. Ids of
+ * freed objects are reused, so they stay below the peak object count.
+ * realloc(NULL, n) is recorded as malloc, and realloc(p, 0) as free.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TRACE_MAGIC 0x52544d4dU	/* "MMTR" */
+#define TRACE_VERSION 1
+
+#define TRACE_MAXREC 31		/* Longest record: op and three varints */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+} trace_hdr_t;
+
+enum {
+	TRACE_MALLOC = 1,
+	TRACE_FREE,
+	TRACE_REALLOC,
+	TRACE_CALLOC,
+	TRACE_MEMALIGN
+};
+
+/* One decoded record */
+typedef struct {
+	unsigned char op;
+	uint32_t id;
+	size_t size;
+	size_t arg;			/* nmemb of calloc, alignment of memalign */
+} trace_op_t;
+
+/*
+ * trace_put_varint - write v at p, return the byte past it
+ */
+static inline unsigned char *trace_put_varint(unsigned char *p, uint64_t v){
+	while (v >= 0x80) {
+		*p++ = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (unsigned char)v;
+	return p;
+}
+
+/*
+ * trace_get_varint - read a varint at p, not past end, into v. Return
+ *		the byte past it, or NULL if it is cut short
+ */
+static inline const unsigned char *trace_get_varint(const unsigned char *p,
+		const unsigned char *end, uint64_t *v){
+	unsigned int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+/*
+ * trace_encode - write the record of op at p, return its length
+ */
+static inline size_t trace_encode(unsigned char *p, const trace_op_t *op){
+	unsigned char *q = p;
+
+	*q++ = op->op;
+	q = trace_put_varint(q, op->id);
+	if (op->op == TRACE_CALLOC || op->op == TRACE_MEMALIGN)
+		q = trace_put_varint(q, op->arg);
+	if (op->op != TRACE_FREE)
+		q = trace_put_varint(q, op->size);
+	return (size_t)(q - p);
+}
+
+/*
+ * trace_decode - read the record at p, not past end, into op. Return
+ *		the byte past it, or NULL if it is malformed
+ */
+static inline const unsigned char *trace_decode(const unsigned char *p,
+		const unsigned char *end, trace_op_t *op){
+	uint64_t v;
+
+	if (p >= end || *p < TRACE_MALLOC || *p > TRACE_MEMALIGN)
+		return NULL;
+	op->op = *p++;
+	op->size = op->arg = 0;
+	if ((p = trace_get_varint(p, end, &v)) == NULL || v > UINT32_MAX)
+		return NULL;
+	op->id = (uint32_t)v;
+	if (op->op == TRACE_CALLOC || op->op == TRACE_MEMALIGN) {
+		if ((p = trace_get_varint(p, end, &v)) == NULL)
+			return NULL;
+		op->arg = (size_t)v;
+	}
+	if (op->op != TRACE_FREE) {
+		if ((p = trace_get_varint(p, end, &v)) == NULL)
+			return NULL;
+		op->size = (size_t)v;
+	}
+	return p;
+}
+
+#endif